@@ -0,0 +1,91 @@
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Measurements taken around a benchmarked call. Allocations are counted by
+// linking with -Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc.
+
+struct bench {
+  struct timespec start;
+  struct timespec stop;
+  int perf_fd;
+  uint64_t instructions;
+  uint64_t allocations;
+  uint64_t allocated_bytes;
+};
+
+struct bench bench = { .perf_fd = -1 };
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  bench.allocations++;
+  bench.allocated_bytes += size;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+  bench.allocations++;
+  bench.allocated_bytes += num * size;
+  return __real_calloc(num, size);
+}
+
+// Reallocations are counted as new allocations of their full size
+void *__wrap_realloc(void *ptr, size_t size) {
+  bench.allocations++;
+  bench.allocated_bytes += size;
+  return __real_realloc(ptr, size);
+}
+
+// Count user space instructions, if the kernel lets us
+int bench_perf_open() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void bench_start() {
+  bench.perf_fd = bench_perf_open();
+  bench.allocations = 0;
+  bench.allocated_bytes = 0;
+  if(bench.perf_fd >= 0) {
+    ioctl(bench.perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(bench.perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &bench.start);
+}
+
+void bench_stop() {
+  clock_gettime(CLOCK_MONOTONIC, &bench.stop);
+  if(bench.perf_fd >= 0) {
+    ioctl(bench.perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if(read(bench.perf_fd, &bench.instructions, sizeof(bench.instructions)) != sizeof(bench.instructions)) {
+      close(bench.perf_fd);
+      bench.perf_fd = -1;
+    }
+  }
+}
+
+// Print the measurements as a single line of JSON
+void bench_report() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  int64_t wall_ns = (int64_t) (bench.stop.tv_sec - bench.start.tv_sec) * 1000000000 + (bench.stop.tv_nsec - bench.start.tv_nsec);
+  printf("{\"wall_ns\": %lld, ", (long long) wall_ns);
+  if(bench.perf_fd >= 0) printf("\"instructions\": %llu, ", (unsigned long long) bench.instructions);
+  else printf("\"instructions\": null, ");
+  printf("\"allocations\": %llu, \"allocated_bytes\": %llu, \"peak_rss_kb\": %ld}\n",
+         (unsigned long long) bench.allocations, (unsigned long long) bench.allocated_bytes, usage.ru_maxrss);
+}
+
@@ -0,0 +1,174 @@
+#include <erl_nif.h>
+
+// Every scheduler thread gets its own virtual machine state
+#define EX2C_THREADED
+#define EX2C_NO_GUEST_ENV "inside the BEAM"
+#include "ex2crt.h"
+
+// Conversion from BEAM terms into runtime terms
+
+bool nif_to_term(ErlNifEnv *env, ERL_NIF_TERM t, struct term *u) {
+  int value;
+  unsigned length;
+  int arity;
+  const ERL_NIF_TERM *elements;
+  ERL_NIF_TERM head, tail;
+  ErlNifBinary binary;
+  size_t size;
+  if(enif_get_int(env, t, &value)) {
+    *u = make_small(value);
+    return true;
+  } else if(enif_get_atom_length(env, t, &length, ERL_NIF_UTF8)) {
+    // Atoms are UTF-8 in the runtime, and the terminator needs room too
+    char *name = (char *) term_malloc(length + 1);
+    enif_get_atom(env, t, name, length + 1, ERL_NIF_UTF8);
+    *u = make_atom(length, name);
+    return true;
+  } else if(enif_get_tuple(env, t, &arity, &elements)) {
+    // The arity comes from the caller, so the elements are built on the heap
+    struct term *values = (struct term *) term_calloc(arity, sizeof(struct term));
+    for(int i = 0; i < arity; i++) {
+      if(!nif_to_term(env, elements[i], &values[i])) return false;
+    }
+    *u = make_tuple_scoped(arity, values);
+    return true;
+  } else if(enif_is_empty_list(env, t)) {
+    *u = make_nil();
+    return true;
+  } else if(enif_get_list_cell(env, t, &head, &tail)) {
+    // Convert the spine iteratively so that long lists do not exhaust the C stack
+    struct term *cell = u;
+    for(; enif_get_list_cell(env, t, &head, &tail); t = tail) {
+      cell->type = LIST;
+      cell->list.head = (struct term *) term_malloc(sizeof(struct term));
+      cell->list.tail = (struct term *) term_malloc(sizeof(struct term));
+      if(!nif_to_term(env, head, cell->list.head)) return false;
+      cell = cell->list.tail;
+    }
+    return nif_to_term(env, t, cell);
+  } else if(enif_inspect_binary(env, t, &binary)) {
+    *u = make_bitstring(binary.size * 8, binary.data);
+    return true;
+  } else if(enif_get_map_size(env, t, &size)) {
+    struct term *keys = (struct term *) term_calloc(size, sizeof(struct term));
+    struct term *values = (struct term *) term_calloc(size, sizeof(struct term));
+    ErlNifMapIterator iter;
+    enif_map_iterator_create(env, t, &iter, ERL_NIF_MAP_ITERATOR_FIRST);
+    for(int i = 0; i < size; i++, enif_map_iterator_next(env, &iter)) {
+      ERL_NIF_TERM key, value;
+      enif_map_iterator_get_pair(env, &iter, &key, &value);
+      if(!nif_to_term(env, key, &keys[i]) || !nif_to_term(env, value, &values[i])) {
+        enif_map_iterator_destroy(env, &iter);
+        return false;
+      }
+    }
+    enif_map_iterator_destroy(env, &iter);
+    *u = put_map_assoc_nofail(make_map(), keys, values, size);
+    term_free(keys);
+    term_free(values);
+    return true;
+  } else {
+    // Big integers, floats, funs, pids, ports and references are not supported
+    return false;
+  }
+}
+
+// Conversion from runtime terms into BEAM terms
+
+bool term_to_nif(ErlNifEnv *env, const struct term *t, ERL_NIF_TERM *u) {
+  switch(t->type) {
+  case NIL:
+    *u = enif_make_list(env, 0);
+    return true;
+  case LIST: {
+    int length = 0;
+    const struct term *cell = t;
+    for(; cell->type == LIST; cell = cell->list.tail) length++;
+    // Build the list back to front, starting from its possibly improper tail.
+    // Its length is unbounded, so the converted elements are kept on the heap.
+    ERL_NIF_TERM *elements = (ERL_NIF_TERM *) enif_alloc(length * sizeof(ERL_NIF_TERM));
+    cell = t;
+    bool converted = true;
+    for(int i = 0; converted && i < length; i++, cell = cell->list.tail) {
+      converted = term_to_nif(env, cell->list.head, &elements[i]);
+    }
+    converted = converted && term_to_nif(env, cell, u);
+    for(int i = length - 1; converted && i >= 0; i--) *u = enif_make_list_cell(env, elements[i], *u);
+    enif_free(elements);
+    return converted;
+  } case SMALL:
+    *u = enif_make_int(env, t->small.value);
+    return true;
+  case ATOM:
+    return enif_make_new_atom_len(env, t->atom.value, t->atom.length, u, ERL_NIF_UTF8);
+  case TUPLE: {
+    ERL_NIF_TERM *elements = (ERL_NIF_TERM *) enif_alloc(t->tuple.length * sizeof(ERL_NIF_TERM));
+    bool converted = true;
+    for(int i = 0; converted && i < t->tuple.length; i++) {
+      converted = term_to_nif(env, &t->tuple.values[i], &elements[i]);
+    }
+    if(converted) *u = enif_make_tuple_from_array(env, elements, t->tuple.length);
+    enif_free(elements);
+    return converted;
+  } case FUN:
+    return false;
+  case BITSTRING: {
+    // Only whole binaries can be constructed through the NIF interface
+    if(t->bitstring.length % 8) return false;
+    int byte_size = t->bitstring.length / 8;
+    memcpy(enif_make_new_binary(env, byte_size, u), t->bitstring.bytes, byte_size);
+    return true;
+  } case MAP:
+    *u = enif_make_new_map(env);
+    for(const struct map *map = t->map; map; map = map->tail) {
+      ERL_NIF_TERM key, value;
+      if(!term_to_nif(env, &map->key, &key) || !term_to_nif(env, &map->value, &value)) return false;
+      enif_make_map_put(env, *u, key, value, u);
+    }
+    return true;
+  }
+  return false;
+}
+
+// Call a compiled function with the arguments of a NIF. Its terms are
+// allocated from the arena of the thread, which is reset once the result has
+// been copied into the BEAM, and its runtime errors are raised as exceptions.
+
+EX2C_THREAD_LOCAL struct arena nif_arena = { NULL };
+
+ERL_NIF_TERM nif_run(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[], struct term (*fun)()) {
+  jmp_buf handler;
+  if(setjmp(handler)) {
+    error_handler = NULL;
+    ERL_NIF_TERM reason;
+    if(!term_to_nif(env, &error_reason, &reason)) reason = enif_make_atom(env, "unsupported_term");
+    return enif_raise_exception(env, reason);
+  }
+  error_handler = &handler;
+  for(int i = 0; i < argc; i++) {
+    if(!nif_to_term(env, argv[i], &xs[i])) {
+      error_handler = NULL;
+      return enif_make_badarg(env);
+    }
+  }
+  struct term result = fun();
+  error_handler = NULL;
+  ERL_NIF_TERM output;
+  if(!term_to_nif(env, &result, &output)) {
+    return enif_raise_exception(env, enif_make_atom(env, "unsupported_term"));
+  }
+  return output;
+}
+
+ERL_NIF_TERM nif_call(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[], struct term (*fun)()) {
+  E = stack + EX2C_STACK_SIZE;
+  term_arena = &nif_arena;
+  ERL_NIF_TERM output = nif_run(env, argc, argv, fun);
+  term_arena = NULL;
+  arena_reset(&nif_arena);
+#ifdef EX2C_HASHCONS
+  // Interned terms were allocated from the arena too
+  hashcons_clear();
+#endif
+  return output;
+}
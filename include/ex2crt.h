@@ -1,8 +1,25 @@
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <setjmp.h>
+
+// Global state is kept per thread when EX2C_THREADED is defined, for hosts
+// such as the BEAM that call into compiled code from several threads
+
+#ifdef EX2C_THREADED
+#define EX2C_THREAD_LOCAL _Thread_local
+#else
+#define EX2C_THREAD_LOCAL
+#endif
+
+// Raising an exception never returns, so keep it out of line and let the
+// compiler treat the paths leading to it as unlikely
+
+#define EX2C_ERROR __attribute__((cold, noinline, noreturn))
 
 // Definition of a term
 
@@ -72,6 +89,203 @@ struct map {
   struct map *tail;
 };
 
+// Profiling of compiled code. Instrumented functions own an array of sites:
+// their entry, each of their blocks and each of their instructions that may
+// allocate. Term storage is charged to the site most recently reached when
+// EX2C_PROFILE is defined.
+
+struct profile_site {
+  const char *function;
+  const char *site;
+  uint64_t count;
+  uint64_t bytes;
+};
+
+struct profile_function {
+  struct profile_site *sites;
+  uint32_t size;
+  bool registered;
+  struct profile_function *next;
+};
+
+struct profile_function *profile_functions = NULL;
+
+EX2C_THREAD_LOCAL struct profile_site *profile_current = NULL;
+
+// Sites are shared by every thread running compiled code, so their counters
+// are updated atomically when EX2C_THREADED is defined. Relaxed ordering is
+// enough since they are only read as statistics.
+
+static inline void profile_add(uint64_t *counter, uint64_t n) {
+#ifdef EX2C_THREADED
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+  *counter += n;
+#endif
+}
+
+static inline uint64_t profile_load(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void profile_at(struct profile_site *site) {
+  profile_add(&site->count, 1);
+  profile_current = site;
+}
+
+void profile_enter(struct profile_function *function) {
+  // Functions register themselves the first time that they are entered. Only
+  // the thread that claims the flag links the function, which is published
+  // with its next pointer already set.
+  if(!__atomic_load_n(&function->registered, __ATOMIC_ACQUIRE) &&
+     !__atomic_exchange_n(&function->registered, true, __ATOMIC_ACQ_REL)) {
+    function->next = __atomic_load_n(&profile_functions, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&profile_functions, &function->next, function, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+  profile_at(&function->sites[0]);
+}
+
+// Arenas hand out storage that is only released all at once, which lets
+// hosts such as the BEAM reclaim everything that a call allocated
+
+#ifndef EX2C_ARENA_CHUNK_SIZE
+#define EX2C_ARENA_CHUNK_SIZE 65536
+#endif
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t capacity;
+  size_t used;
+  max_align_t bytes[];
+};
+
+struct arena {
+  struct arena_chunk *chunks;
+};
+
+void *arena_malloc(struct arena *arena, size_t size) {
+  size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+  struct arena_chunk *chunk = arena->chunks;
+  if(!chunk || chunk->capacity - chunk->used < size) {
+    size_t capacity = size > EX2C_ARENA_CHUNK_SIZE ? size : EX2C_ARENA_CHUNK_SIZE;
+    chunk = (struct arena_chunk *) malloc(sizeof(struct arena_chunk) + capacity);
+    chunk->next = arena->chunks;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    arena->chunks = chunk;
+  }
+  void *ptr = (unsigned char *) chunk->bytes + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+// Release every chunk but one of the default size, which is kept for reuse
+void arena_reset(struct arena *arena) {
+  struct arena_chunk *kept = NULL;
+  for(struct arena_chunk *chunk = arena->chunks, *next; chunk; chunk = next) {
+    next = chunk->next;
+    if(!kept && chunk->capacity == EX2C_ARENA_CHUNK_SIZE) {
+      kept = chunk;
+      kept->next = NULL;
+      kept->used = 0;
+    } else {
+      free(chunk);
+    }
+  }
+  arena->chunks = kept;
+}
+
+// Allocation of term storage, from the arena of the thread if it has one
+
+EX2C_THREAD_LOCAL struct arena *term_arena = NULL;
+
+void *term_malloc(size_t size) {
+#ifdef EX2C_PROFILE
+  if(profile_current) profile_add(&profile_current->bytes, size);
+#endif
+  if(term_arena) return arena_malloc(term_arena, size);
+  return malloc(size);
+}
+
+void *term_calloc(size_t num, size_t size) {
+#ifdef EX2C_PROFILE
+  if(profile_current) profile_add(&profile_current->bytes, num * size);
+#endif
+  if(term_arena) return memset(arena_malloc(term_arena, num * size), 0, num * size);
+  return calloc(num, size);
+}
+
+void *term_realloc(void *ptr, size_t old_size, size_t size) {
+#ifdef EX2C_PROFILE
+  if(profile_current && size > old_size) profile_add(&profile_current->bytes, size - old_size);
+#endif
+  if(term_arena) {
+    void *copy = arena_malloc(term_arena, size);
+    if(old_size) memcpy(copy, ptr, old_size < size ? old_size : size);
+    return copy;
+  }
+  return realloc(ptr, size);
+}
+
+void term_free(void *ptr) {
+  if(!term_arena) free(ptr);
+}
+
+// Copy up to capacity sites into output and return the total number of sites
+size_t profile_snapshot(struct profile_site *output, size_t capacity) {
+  size_t size = 0;
+  struct profile_function *functions = __atomic_load_n(&profile_functions, __ATOMIC_ACQUIRE);
+  for(struct profile_function *function = functions; function; function = function->next) {
+    for(int i = 0; i < function->size; i++, size++) {
+      if(size < capacity) {
+        const struct profile_site *site = &function->sites[i];
+        output[size] = (struct profile_site) { site->function, site->site, profile_load(&site->count), profile_load(&site->bytes) };
+      }
+    }
+  }
+  return size;
+}
+
+void profile_reset() {
+  struct profile_function *functions = __atomic_load_n(&profile_functions, __ATOMIC_ACQUIRE);
+  for(struct profile_function *function = functions; function; function = function->next) {
+    for(int i = 0; i < function->size; i++) {
+      __atomic_store_n(&function->sites[i].count, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&function->sites[i].bytes, 0, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+int profile_site_cmp(const void *a, const void *b) {
+  const struct profile_site *u = (const struct profile_site *) a, *v = (const struct profile_site *) b;
+  if(u->bytes != v->bytes) return u->bytes < v->bytes ? 1 : -1;
+  if(u->count != v->count) return u->count < v->count ? 1 : -1;
+  return 0;
+}
+
+// Write a flat profile to the given path, heaviest allocation sites first
+bool profile_dump(const char *path) {
+  size_t size = profile_snapshot(NULL, 0);
+  struct profile_site *sites = (struct profile_site *) calloc(size, sizeof(struct profile_site));
+  // Functions entered since the sites were counted are left out
+  profile_snapshot(sites, size);
+  qsort(sites, size, sizeof(struct profile_site), profile_site_cmp);
+  FILE *file = fopen(path, "w");
+  if(!file) {
+    free(sites);
+    return false;
+  }
+  fprintf(file, "%14s %14s  %s\n", "count", "bytes", "site");
+  for(int i = 0; i < size; i++) {
+    fprintf(file, "%14llu %14llu  %s:%s\n", (unsigned long long) sites[i].count,
+            (unsigned long long) sites[i].bytes, sites[i].function, sites[i].site);
+  }
+  fclose(file);
+  free(sites);
+  return true;
+}
+
 // Convenience functions for term construction
 
 int bit_to_byte_size(int length) { return (length + 7) / 8; }
@@ -95,19 +309,29 @@ struct term make_tuple(uint32_t len, struct term *values) {
   struct term t;
   t.type = TUPLE;
   t.tuple.length = len;
-  t.tuple.values = (struct term *) calloc(len, sizeof(struct term));
+  t.tuple.values = (struct term *) term_calloc(len, sizeof(struct term));
   for(int i = 0; i < len; i++) {
     t.tuple.values[i] = values[i];
   }
   return t;
 }
 
+// Construct a tuple around elements owned by the caller, for tuples that do
+// not outlive the block creating them
+struct term make_tuple_scoped(uint32_t len, struct term *values) {
+  struct term t;
+  t.type = TUPLE;
+  t.tuple.length = len;
+  t.tuple.values = values;
+  return t;
+}
+
 struct term make_list(struct term head, struct term tail) {
   struct term t;
   t.type = LIST;
-  t.list.head = (struct term *) malloc(sizeof(struct term));
+  t.list.head = (struct term *) term_malloc(sizeof(struct term));
   *t.list.head = head;
-  t.list.tail = (struct term *) malloc(sizeof(struct term));
+  t.list.tail = (struct term *) term_malloc(sizeof(struct term));
   *t.list.tail = tail;
   return t;
 } 
@@ -126,19 +350,33 @@ struct term make_fun(struct term (*ptr)(), char *id, uint32_t id_len, uint32_t a
   t.fun.id_len = id_len;
   t.fun.arity = arity;
   t.fun.num_free = num_free;
-  t.fun.env = (struct term *) calloc(num_free, sizeof(struct term));
+  t.fun.env = (struct term *) term_calloc(num_free, sizeof(struct term));
   for(int i = 0; i < num_free; i++) {
     t.fun.env[i] = env[i];
   }
   return t;
 }
 
+// Construct a fun around an environment owned by the caller, for funs that
+// do not outlive the block creating them
+struct term make_fun_scoped(struct term (*ptr)(), char *id, uint32_t id_len, uint32_t arity, uint32_t num_free, struct term *env) {
+  struct term t;
+  t.type = FUN;
+  t.fun.ptr = ptr;
+  t.fun.id = id;
+  t.fun.id_len = id_len;
+  t.fun.arity = arity;
+  t.fun.num_free = num_free;
+  t.fun.env = env;
+  return t;
+}
+
 struct term make_bitstring(uint32_t length, unsigned char *bytes) {
   struct term t;
   t.type = BITSTRING;
   t.bitstring.length = length;
   int byte_size = bit_to_byte_size(length);
-  t.bitstring.bytes = (unsigned char *) malloc(byte_size);
+  t.bitstring.bytes = (unsigned char *) term_malloc(byte_size);
   memcpy(t.bitstring.bytes, bytes, byte_size);
   return t;
 }
@@ -150,11 +388,202 @@ struct term make_map() {
   return t;
 }
 
+// Hash-consing of terms so that structurally equal subterms share storage
+
+struct hashcons_entry {
+  bool used;
+  uint32_t hash;
+  struct term term;
+};
+
+struct hashcons_table {
+  struct hashcons_entry *entries;
+  uint32_t capacity;
+  uint32_t size;
+};
+
+EX2C_THREAD_LOCAL struct hashcons_table hashcons = { NULL, 0, 0 };
+
+uint32_t hash_combine(uint32_t h, uint32_t v) {
+  h = (h ^ v) * 16777619u;
+  return h ^ (h >> 15);
+}
+
+uint32_t hash_pointer(uint32_t h, const void *ptr) {
+  uint64_t v = (uintptr_t) ptr;
+  return hash_combine(hash_combine(h, (uint32_t) v), (uint32_t) (v >> 32));
+}
+
+uint32_t hash_bytes(uint32_t h, const unsigned char *bytes, uint32_t len) {
+  for(int i = 0; i < len; i++) h = hash_combine(h, bytes[i]);
+  return h;
+}
+
+// Hash a term by identity: immediates and atoms by value, boxed terms by address
+uint32_t shallow_hash(const struct term *t) {
+  uint32_t h = hash_combine(2166136261u, t->type);
+  switch(t->type) {
+  case NIL: return h;
+  case SMALL: return hash_combine(h, (uint32_t) t->small.value);
+  case ATOM: return hash_bytes(h, (const unsigned char *) t->atom.value, t->atom.length);
+  case LIST: return hash_pointer(hash_pointer(h, t->list.head), t->list.tail);
+  case TUPLE: return hash_pointer(hash_combine(h, t->tuple.length), t->tuple.values);
+  case FUN: return hash_pointer(hash_pointer(h, (const void *) t->fun.ptr), t->fun.env);
+  case BITSTRING: return hash_pointer(hash_combine(h, t->bitstring.length), t->bitstring.bytes);
+  case MAP: return hash_pointer(h, t->map);
+  }
+  abort();
+}
+
+// Compare two terms by identity, which implies but is stronger than equality
+bool shallow_eq(const struct term *t, const struct term *u) {
+  if(t->type != u->type) return false;
+  switch(t->type) {
+  case NIL: return true;
+  case SMALL: return t->small.value == u->small.value;
+  case ATOM:
+    return t->atom.length == u->atom.length &&
+      (t->atom.value == u->atom.value || memcmp(t->atom.value, u->atom.value, t->atom.length) == 0);
+  case LIST: return t->list.head == u->list.head && t->list.tail == u->list.tail;
+  case TUPLE: return t->tuple.length == u->tuple.length && t->tuple.values == u->tuple.values;
+  case FUN:
+    return t->fun.ptr == u->fun.ptr && t->fun.num_free == u->fun.num_free && t->fun.env == u->fun.env;
+  case BITSTRING: return t->bitstring.length == u->bitstring.length && t->bitstring.bytes == u->bitstring.bytes;
+  case MAP: return t->map == u->map;
+  }
+  abort();
+}
+
+// Hash the contents of a candidate table entry one level deep
+uint32_t hashcons_hash(const struct term *t) {
+  uint32_t h = hash_combine(2166136261u, t->type);
+  switch(t->type) {
+  case LIST:
+    return hash_combine(hash_combine(h, shallow_hash(t->list.head)), shallow_hash(t->list.tail));
+  case TUPLE:
+    h = hash_combine(h, t->tuple.length);
+    for(int i = 0; i < t->tuple.length; i++) h = hash_combine(h, shallow_hash(&t->tuple.values[i]));
+    return h;
+  case BITSTRING:
+    return hash_bytes(hash_combine(h, t->bitstring.length), t->bitstring.bytes, bit_to_byte_size(t->bitstring.length));
+  default:
+    return shallow_hash(t);
+  }
+}
+
+// Compare the contents of two table entries one level deep
+bool hashcons_eq(const struct term *t, const struct term *u) {
+  if(t->type != u->type) return false;
+  switch(t->type) {
+  case LIST:
+    return shallow_eq(t->list.head, u->list.head) && shallow_eq(t->list.tail, u->list.tail);
+  case TUPLE:
+    if(t->tuple.length != u->tuple.length) return false;
+    for(int i = 0; i < t->tuple.length; i++) {
+      if(!shallow_eq(&t->tuple.values[i], &u->tuple.values[i])) return false;
+    }
+    return true;
+  case BITSTRING:
+    return t->bitstring.length == u->bitstring.length &&
+      memcmp(t->bitstring.bytes, u->bitstring.bytes, bit_to_byte_size(t->bitstring.length)) == 0;
+  default:
+    return shallow_eq(t, u);
+  }
+}
+
+struct hashcons_entry *hashcons_probe(struct hashcons_entry *entries, uint32_t capacity, const struct term *t, uint32_t hash) {
+  uint32_t mask = capacity - 1;
+  for(uint32_t i = hash & mask;; i = (i + 1) & mask) {
+    struct hashcons_entry *entry = &entries[i];
+    if(!entry->used || (entry->hash == hash && hashcons_eq(&entry->term, t))) return entry;
+  }
+}
+
+void hashcons_reserve() {
+  // Keep the load factor at or below one half
+  if(2 * (hashcons.size + 1) <= hashcons.capacity) return;
+  uint32_t capacity = hashcons.capacity ? 2 * hashcons.capacity : 1024;
+  struct hashcons_entry *entries = (struct hashcons_entry *) calloc(capacity, sizeof(struct hashcons_entry));
+  for(int i = 0; i < hashcons.capacity; i++) {
+    struct hashcons_entry *entry = &hashcons.entries[i];
+    if(entry->used) *hashcons_probe(entries, capacity, &entry->term, entry->hash) = *entry;
+  }
+  free(hashcons.entries);
+  hashcons.entries = entries;
+  hashcons.capacity = capacity;
+}
+
+// Find the entry equal to the given candidate, or the empty entry that it should occupy
+struct hashcons_entry *hashcons_find(const struct term *t) {
+  hashcons_reserve();
+  uint32_t hash = hashcons_hash(t);
+  struct hashcons_entry *entry = hashcons_probe(hashcons.entries, hashcons.capacity, t, hash);
+  entry->hash = hash;
+  return entry;
+}
+
+struct term hashcons_insert(struct hashcons_entry *entry, struct term t) {
+  entry->used = true;
+  entry->term = t;
+  hashcons.size++;
+  return t;
+}
+
+// Forget every interned term, for instance once the arena holding them is reset
+void hashcons_clear() {
+  if(hashcons.entries) memset(hashcons.entries, 0, hashcons.capacity * sizeof(struct hashcons_entry));
+  hashcons.size = 0;
+}
+
+struct term make_atom_shared(uint32_t len, char *value) {
+  struct term t = make_atom(len, value);
+  struct hashcons_entry *entry = hashcons_find(&t);
+  return entry->used ? entry->term : hashcons_insert(entry, t);
+}
+
+struct term make_tuple_shared(uint32_t len, struct term *values) {
+  struct term t;
+  t.type = TUPLE;
+  t.tuple.length = len;
+  t.tuple.values = values;
+  struct hashcons_entry *entry = hashcons_find(&t);
+  return entry->used ? entry->term : hashcons_insert(entry, make_tuple(len, values));
+}
+
+struct term make_list_shared(struct term head, struct term tail) {
+  struct term t;
+  t.type = LIST;
+  t.list.head = &head;
+  t.list.tail = &tail;
+  struct hashcons_entry *entry = hashcons_find(&t);
+  return entry->used ? entry->term : hashcons_insert(entry, make_list(head, tail));
+}
+
+struct term make_bitstring_shared(uint32_t length, unsigned char *bytes) {
+  struct term t;
+  t.type = BITSTRING;
+  t.bitstring.length = length;
+  t.bitstring.bytes = bytes;
+  struct hashcons_entry *entry = hashcons_find(&t);
+  return entry->used ? entry->term : hashcons_insert(entry, make_bitstring(length, bytes));
+}
+
 // State of the virtual machine
 
-struct term xs[128];
-struct term stack[128];
-struct term *E = stack + 128;
+// Number of terms on the stack, which bounds the depth of body recursion
+#ifndef EX2C_STACK_SIZE
+#define EX2C_STACK_SIZE 128
+#endif
+
+EX2C_THREAD_LOCAL struct term xs[128];
+EX2C_THREAD_LOCAL struct term stack[EX2C_STACK_SIZE];
+#ifdef EX2C_THREADED
+// The address of thread-local storage is not a constant, so hosts must point
+// E at the top of the stack before entering compiled code
+_Thread_local struct term *E;
+#else
+struct term *E = stack + EX2C_STACK_SIZE;
+#endif
 
 // Foreign Function Interface
 
@@ -240,7 +669,7 @@ void display_aux(const struct term *t) {
       printf("%i", t->small.value);
       break;
     case ATOM:
-      printf(":%s", t->atom.value);
+      printf(":%.*s", (int) t->atom.length, t->atom.value);
       break;
     case TUPLE:
       printf("{");
@@ -268,9 +697,9 @@ void display_aux(const struct term *t) {
     const struct map *map = t->map;
     for(int i = 0; map; i++, map = map->tail) {
       if(i) printf(", ");
-      display_aux(&t->map->key);
+      display_aux(&map->key);
       printf(" => ");
-      display_aux(&t->map->value);
+      display_aux(&map->value);
     }
     printf("}");
     break;
@@ -282,6 +711,27 @@ void display(struct term t) {
   printf("\n");
 }
 
+// Runtime errors abort the process unless the host has set a recovery point,
+// which the BEAM uses to raise them as exceptions in the calling process
+
+EX2C_THREAD_LOCAL jmp_buf *error_handler = NULL;
+EX2C_THREAD_LOCAL struct term error_reason;
+
+// Raise the given exit reason, describing it with message if not NULL when aborting
+EX2C_ERROR void raise_error(struct term reason, const char *message) {
+  if(error_handler) {
+    error_reason = reason;
+    longjmp(*error_handler, 1);
+  }
+  if(message) {
+    printf("%s", message);
+  } else {
+    printf("exception error:");
+    display(reason);
+  }
+  abort();
+}
+
 bool is_tuple(struct term t) {
   return t.type == TUPLE;
 }
@@ -307,6 +757,18 @@ void put_list(struct term hd, struct term tl, struct term *t) {
   *t = make_list(hd, tl);
 }
 
+void put_list_shared(struct term hd, struct term tl, struct term *t) {
+  *t = make_list_shared(hd, tl);
+}
+
+// Construct a list cell around the head and tail held by the caller in cell,
+// for cells that do not outlive the block creating them
+void put_list_scoped(struct term *cell, struct term *t) {
+  t->type = LIST;
+  t->list.head = &cell[0];
+  t->list.tail = &cell[1];
+}
+
 void get_hd(struct term t, struct term *hd) {
   *hd = *t.list.head;
 }
@@ -336,16 +798,20 @@ int cmp_exact(struct term t, struct term u) {
   case NIL:
     return 0;
   case LIST: {
+    // Shared subterms are equal by identity
+    if(t.list.head == u.list.head && t.list.tail == u.list.tail) return 0;
     int diff = cmp_exact(*t.list.head, *u.list.head);
     return diff ? diff : cmp_exact(*t.list.tail, *u.list.tail);
   } case SMALL:
     return t.small.value - u.small.value;
   case ATOM: {
+    if(t.atom.value == u.atom.value && t.atom.length == u.atom.length) return 0;
     int diff = memcmp(t.atom.value, u.atom.value, min(t.atom.length, u.atom.length));
     return diff ? diff : t.atom.length - u.atom.length;
   } case TUPLE: {
       int diff = t.tuple.length - u.tuple.length;
       if(diff) return diff;
+      if(t.tuple.values == u.tuple.values) return 0;
       for(int i = 0; i < t.tuple.length; i++) {
         int diff = cmp_exact(t.tuple.values[i], u.tuple.values[i]);
         if(diff) {
@@ -354,6 +820,7 @@ int cmp_exact(struct term t, struct term u) {
       }
       return 0;
     } case BITSTRING: {
+        if(t.bitstring.bytes == u.bitstring.bytes && t.bitstring.length == u.bitstring.length) return 0;
         int diff = memcmp(t.bitstring.bytes, u.bitstring.bytes, bit_to_byte_size(min(t.bitstring.length, u.bitstring.length)));
         return diff ? diff : t.bitstring.length - u.bitstring.length;
       } case FUN: {
@@ -371,6 +838,7 @@ int cmp_exact(struct term t, struct term u) {
           return 0;
         }
   case MAP: {
+    if(t.map == u.map) return 0;
     int diff = map_size(t) - map_size(u);
     if(diff) return diff;
     struct map *v = t.map, *w = u.map;
@@ -458,30 +926,44 @@ int bif_length(struct term a, struct term *b) {
 }
 
 struct term erlang_get_module_info_1() {
-  abort();
+  raise_error(make_atom(5, "undef"), "get_module_info/1 not implemented");
 }
 
 struct term erlang_get_module_info_2() {
-  abort();
+  raise_error(make_atom(5, "undef"), "get_module_info/2 not implemented");
 }
 
 struct term erlang_2B_2() {
   struct term c;
-  if(!bif_2B(xs[0], xs[1], &c)) abort();
+  if(!bif_2B(xs[0], xs[1], &c)) raise_error(make_atom(8, "badarith"), NULL);
   else return c;
 }
 
 int cmp_exact_r(const void *a, const void *b) {
   const struct term **a_term = (const struct term **) a;
   const struct term **b_term = (const struct term **) b;
-  return cmp(**a_term, **b_term);
+  return cmp_exact(**a_term, **b_term);
 }
 
-bool put_map_assoc(struct term map_term, struct term *dst, struct term *keys, struct term *values, size_t size) {
-  // Sort the supplied keys in preparation forr map insertion
-  struct term *key_ptrs[size];
-  for(int i = 0; i < size; i++) key_ptrs[i] = &keys[i];
+// Sort pointers to the supplied keys in preparation for map insertion. Their
+// number may come from the input of the program, so they live on the heap.
+struct term **sort_keys(struct term *keys, size_t size) {
+  struct term **key_ptrs = (struct term **) malloc(size * sizeof(struct term *));
+  for(size_t i = 0; i < size; i++) key_ptrs[i] = &keys[i];
   qsort(key_ptrs, size, sizeof(struct term *), cmp_exact_r);
+  return key_ptrs;
+}
+
+bool has_duplicate_keys(struct term *keys, size_t size) {
+  struct term **key_ptrs = sort_keys(keys, size);
+  bool duplicate = false;
+  for(size_t i = 1; !duplicate && i < size; i++) duplicate = cmp_exact(*key_ptrs[i - 1], *key_ptrs[i]) == 0;
+  free(key_ptrs);
+  return duplicate;
+}
+
+bool put_map_assoc(struct term map_term, struct term *dst, struct term *keys, struct term *values, size_t size) {
+  struct term **key_ptrs = sort_keys(keys, size);
 
   struct map *map = map_term.map;
   struct map *new_map = map;
@@ -492,19 +974,20 @@ bool put_map_assoc(struct term map_term, struct term *dst, struct term *keys, st
     int diff = true;
     // Duplicate the map until we get to the matching entry
     for(; map && (diff = cmp_exact(map->key, keys[j])) < 0; map = map->tail) {
-      *new_map_ptr = (struct map *) malloc(sizeof(struct map));
+      *new_map_ptr = (struct map *) term_malloc(sizeof(struct map));
       (*new_map_ptr)->key = map->key;
       (*new_map_ptr)->value = map->value;
       (*new_map_ptr)->tail = map->tail;
       new_map_ptr = &(*new_map_ptr)->tail;
     }
     // Construct the map entry that will contain the given key-value pair
-    *new_map_ptr = (struct map *) malloc(sizeof(struct map));
+    *new_map_ptr = (struct map *) term_malloc(sizeof(struct map));
     (*new_map_ptr)->key = keys[j];
     (*new_map_ptr)->value = values[j];
     (*new_map_ptr)->tail = diff ? map : map->tail;
     new_map_ptr = &(*new_map_ptr)->tail;
   }
+  free(key_ptrs);
   // Finally construct a term from the map with the new association
   dst->type = MAP;
   dst->map = new_map;
@@ -518,10 +1001,7 @@ struct term put_map_assoc_nofail(struct term map_term, struct term *keys, struct
 }
 
 bool put_map_exact(struct term map_term, struct term *dst, struct term *keys, struct term *values, size_t size) {
-  // Sort the supplied keys in preparation forr map insertion
-  struct term *key_ptrs[size];
-  for(int i = 0; i < size; i++) key_ptrs[i] = &keys[i];
-  qsort(key_ptrs, size, sizeof(struct term *), cmp_exact_r);
+  struct term **key_ptrs = sort_keys(keys, size);
 
   struct map *map = map_term.map;
   struct map *new_map = map;
@@ -532,21 +1012,25 @@ bool put_map_exact(struct term map_term, struct term *dst, struct term *keys, st
     int diff = true;
     // Duplicate the map until we get to the matching entry
     for(; map && (diff = cmp_exact(map->key, keys[j])) < 0; map = map->tail) {
-      *new_map_ptr = (struct map *) malloc(sizeof(struct map));
+      *new_map_ptr = (struct map *) term_malloc(sizeof(struct map));
       (*new_map_ptr)->key = map->key;
       (*new_map_ptr)->value = map->value;
       (*new_map_ptr)->tail = map->tail;
       new_map_ptr = &(*new_map_ptr)->tail;
     }
     // If diff != 0, then we did not arrive at equal term.
-    if(diff) return false;
+    if(diff) {
+      free(key_ptrs);
+      return false;
+    }
     // Construct the map entry that will contain the given key-value pair
-    *new_map_ptr = (struct map *) malloc(sizeof(struct map));
+    *new_map_ptr = (struct map *) term_malloc(sizeof(struct map));
     (*new_map_ptr)->key = keys[j];
     (*new_map_ptr)->value = values[j];
     (*new_map_ptr)->tail = map->tail;
     new_map_ptr = &(*new_map_ptr)->tail;
   }
+  free(key_ptrs);
   // Finally construct a term from the map with the new association
   dst->type = MAP;
   dst->map = new_map;
@@ -559,28 +1043,20 @@ struct term put_map_exact_nofail(struct term map_term, struct term *keys, struct
   return dst;
 }
 
-struct term erlang_error_1() {
-  printf("exception error:");
-  display(xs[0]);
-  abort();
+EX2C_ERROR struct term erlang_error_1() {
+  raise_error(xs[0], NULL);
 }
 
-struct term erlang_error_2() {
-  printf("exception error:");
-  display(xs[0]);
-  abort();
+EX2C_ERROR struct term erlang_error_2() {
+  raise_error(xs[0], NULL);
 }
 
-struct term erlang_error_3() {
-  printf("exception error:");
-  display(xs[0]);
-  abort();
+EX2C_ERROR struct term erlang_error_3() {
+  raise_error(xs[0], NULL);
 }
 
-struct term erlang_nif_error_1() {
-  printf("exception error:");
-  display(xs[0]);
-  abort();
+EX2C_ERROR struct term erlang_nif_error_1() {
+  raise_error(xs[0], NULL);
 }
 
 struct term erlang_2B2B_2() {
@@ -592,10 +1068,10 @@ struct term erlang_2B2B_2() {
   for(; x0->type == LIST; x0 = x0->list.tail, concat_ptr = concat_ptr->list.tail) {
     concat_ptr->type = LIST;
     concat_ptr->list.head = x0->list.head;
-    concat_ptr->list.tail = (struct term *) malloc(sizeof(struct term));
+    concat_ptr->list.tail = (struct term *) term_malloc(sizeof(struct term));
   }
   // Ensure that the first argument is a proper list
-  assert(x0->type == NIL);
+  if(x0->type != NIL) raise_error(make_atom(6, "badarg"), "argument 1: not a list");
   // Then set the tail of the concatenation to be the second argument
   *concat_ptr = xs[1];
   return concat;
@@ -611,26 +1087,41 @@ bool is_integer(struct term t) { return t.type == SMALL; }
 
 bool is_function2(struct term t, struct term u) {
   if(u.type != SMALL) {
-    printf("argument 2: not an integer");
-    abort();
+    raise_error(make_atom(6, "badarg"), "argument 2: not an integer");
   } else if(u.small.value) {
-    printf("argument 2: out of range");
-    abort();
+    raise_error(make_atom(6, "badarg"), "argument 2: out of range");
   } else {
     return t.type == FUN && u.type == SMALL && t.fun.arity == u.small.value;
   }
 }
 
-void badmatch(struct term t) {
-  struct term exit_reason = make_tuple(2, (struct term []) { make_atom(8, "badmatch"), t });
-  display(exit_reason);
-  abort();
+EX2C_ERROR void badmatch(struct term t) {
+  raise_error(make_tuple(2, (struct term []) { make_atom(8, "badmatch"), t }), NULL);
 }
 
-void case_end(struct term t) {
-  struct term exit_reason = make_tuple(2, (struct term []) { make_atom(11, "case_clause"), t });
-  display(exit_reason);
-  abort();
+EX2C_ERROR void case_end(struct term t) {
+  raise_error(make_tuple(2, (struct term []) { make_atom(11, "case_clause"), t }), NULL);
+}
+
+// Reached when no clause of a function matches its arguments
+EX2C_ERROR void function_clause() {
+  raise_error(make_atom(15, "function_clause"), NULL);
+}
+
+// Reached when an instruction without a failure label fails
+EX2C_ERROR void badarg() {
+  raise_error(make_atom(6, "badarg"), NULL);
+}
+
+EX2C_ERROR void system_limit(const char *message) {
+  raise_error(make_atom(12, "system_limit"), message);
+}
+
+// Reserve a stack frame of n terms, raising system_limit when the stack is
+// too small for it rather than writing past its bottom
+static inline void allocate(int n) {
+  if(E - stack < n) system_limit("stack overflow: increase EX2C_STACK_SIZE");
+  E -= n;
 }
 
 bool bif_element(struct term t, struct term u, struct term *v) {
@@ -644,14 +1135,11 @@ bool bif_element(struct term t, struct term u, struct term *v) {
 
 struct term erlang_setelement_3() {
   if(xs[0].type == SMALL) {
-    printf("1st argument: not an integer");
-    abort();
+    raise_error(make_atom(6, "badarg"), "1st argument: not an integer");
   } else if(xs[0].small.value <= 0 || xs[0].small.value > xs[1].tuple.length) {
-    printf("1st argument: out of range");
-    abort();
+    raise_error(make_atom(6, "badarg"), "1st argument: out of range");
   } else if(xs[1].type != TUPLE) {
-    printf("2nd argument: not a tuple");
-    abort();
+    raise_error(make_atom(6, "badarg"), "2nd argument: not a tuple");
   } else {
     struct term u = make_tuple(xs[0].small.value <= xs[1].tuple.length, xs[1].tuple.values);
     u.tuple.values[xs[0].small.value - 1] = xs[2];
@@ -688,10 +1176,10 @@ struct term erlang_2D2D_2() {
     // Copy the current cell of x0 into duplicate
     duplicate_ptr->type = LIST;
     duplicate_ptr->list.head = x0->list.head;
-    duplicate_ptr->list.tail = (struct term *) malloc(sizeof(struct term));
+    duplicate_ptr->list.tail = (struct term *) term_malloc(sizeof(struct term));
   }
   // Ensure that the first argument is a proper list
-  assert(x0->type == NIL);
+  if(x0->type != NIL) raise_error(make_atom(6, "badarg"), "argument 1: not a list");
   // Then set the tail of the duplicate to nil
   *duplicate_ptr = *x0;
   // Now remove the terms occuring in the second list
@@ -705,7 +1193,7 @@ struct term erlang_2D2D_2() {
         // Remove *x1->list.head by overwriting it with its tail
         *duplicate_ptr = *duplicate_ptr->list.tail;
         // Since the tail has been copied and was created in this function, it's now dangling
-        free(tail);
+        term_free(tail);
         // Only remove one instance of the match
         break;
       } else {
@@ -715,23 +1203,20 @@ struct term erlang_2D2D_2() {
     }
   }
   // Ensure that the second argument is a proper list
-  assert(x1->type == NIL);
+  if(x1->type != NIL) raise_error(make_atom(6, "badarg"), "argument 2: not a list");
   return duplicate;
 }
 
 struct term erlang_integer_to_list_1() {
-  printf("integer_to_list/1 not implemented");
-  abort();
+  raise_error(make_atom(5, "undef"), "integer_to_list/1 not implemented");
 }
 
 struct term erlang_float_to_list_1() {
-  printf("float_to_list/1 not implemented");
-  abort();
+  raise_error(make_atom(5, "undef"), "float_to_list/1 not implemented");
 }
 
 struct term erlang_atom_to_list_1() {
-  printf("atom_to_list/1 not implemented");
-  abort();
+  raise_error(make_atom(5, "undef"), "atom_to_list/1 not implemented");
 }
 
 // Serialization/deserialization functions
@@ -757,9 +1242,7 @@ int borsh_size(const struct term *t) {
     }
     break;
   case FUN:
-    printf("Functions cannot be serialized");
-    abort();
-    break;
+    raise_error(make_atom(6, "badarg"), "Functions cannot be serialized");
   case BITSTRING:
     size += sizeof(uint32_t) + sizeof(uint32_t) + bit_to_byte_size(t->bitstring.length);
     break;
@@ -804,9 +1287,7 @@ void borsh_serialize_term(const struct term *t, unsigned char * const output, in
     }
     break;
   case FUN:
-    printf("Functions cannot be serialized");
-    abort();
-    break;
+    raise_error(make_atom(6, "badarg"), "Functions cannot be serialized");
   case BITSTRING:
     borsh_serialize_uint32(t->bitstring.length, output, pos);
     int byte_size = bit_to_byte_size(t->bitstring.length);
@@ -828,6 +1309,7 @@ void borsh_serialize_term(const struct term *t, unsigned char * const output, in
 
 void env_commit(const uint8_t *buffer_ptr, uintptr_t buffer_size);
 
+#ifndef EX2C_ETF
 struct term Elixir2EGuestEnv_commit_1() {
   int capacity = borsh_size(&xs[0]);
   unsigned char *bytes = (unsigned char *) malloc(capacity);
@@ -836,6 +1318,7 @@ struct term Elixir2EGuestEnv_commit_1() {
   env_commit(bytes, pos);
   return make_bitstring(pos*8, bytes);
 }
+#endif
 
 uint32_t borsh_deserialize_uint32(const unsigned char * const input, int *pos) {
   int output = 0;
@@ -853,27 +1336,40 @@ struct term borsh_deserialize_term(const unsigned char * const input, int *pos)
   case LIST:
     struct term hd = borsh_deserialize_term(input, pos);
     struct term tl = borsh_deserialize_term(input, pos);
+#ifdef EX2C_HASHCONS
+    return make_list_shared(hd, tl);
+#else
     return make_list(hd, tl);
+#endif
   case SMALL:
     return make_small(borsh_deserialize_uint32(input, pos));
   case ATOM: {
     int length = borsh_deserialize_uint32(input, pos);
-    char *value = (char *) malloc(length);
+    char *value = (char *) term_malloc(length);
     for(int i = 0; i < length; i++) {
       value[i] = input[(*pos)++];
     }
+#ifdef EX2C_HASHCONS
+    // Release this copy if an equal atom has already been interned
+    struct term atom = make_atom_shared(length, value);
+    if(atom.atom.value != value) term_free(value);
+    return atom;
+#else
     return make_atom(length, value);
+#endif
   } case TUPLE: {
       int length = borsh_deserialize_uint32(input, pos);
       struct term values[length];
       for(int i = 0; i < length; i++) {
         values[i] = borsh_deserialize_term(input, pos);
       }
+#ifdef EX2C_HASHCONS
+      return make_tuple_shared(length, values);
+#else
       return make_tuple(length, values);
+#endif
     } case FUN: {
-        printf("Functions cannot be deserialized");
-        abort();
-        break;
+        raise_error(make_atom(6, "badarg"), "Functions cannot be deserialized");
       } case BITSTRING: {
           int bit_length = borsh_deserialize_uint32(input, pos);
           int byte_length = borsh_deserialize_uint32(input, pos);
@@ -881,7 +1377,11 @@ struct term borsh_deserialize_term(const unsigned char * const input, int *pos)
           for(int i = 0; i < byte_length; i++) {
             bytes[i] = input[(*pos)++];
           }
+#ifdef EX2C_HASHCONS
+          return make_bitstring_shared(bit_length, bytes);
+#else
           return make_bitstring(bit_length, bytes);
+#endif
         } case MAP: {
             int length = borsh_deserialize_uint32(input, pos);
             struct term keys[length], values[length];
@@ -896,6 +1396,20 @@ struct term borsh_deserialize_term(const unsigned char * const input, int *pos)
 
 uintptr_t env_read(uint8_t *buffer_ptr, uintptr_t buffer_size);
 
+// Hosts without a guest environment define EX2C_NO_GUEST_ENV to the phrase
+// describing them, such as "inside the BEAM", in the errors raised instead
+
+#ifdef EX2C_NO_GUEST_ENV
+void env_commit(const uint8_t *buffer_ptr, uintptr_t buffer_size) {
+  raise_error(make_atom(5, "undef"), "env_commit/2 is not available " EX2C_NO_GUEST_ENV);
+}
+
+uintptr_t env_read(uint8_t *buffer_ptr, uintptr_t buffer_size) {
+  raise_error(make_atom(5, "undef"), "env_read/2 is not available " EX2C_NO_GUEST_ENV);
+}
+#endif
+
+#ifndef EX2C_ETF
 struct term Elixir2EGuestEnv_read_0() {
   const int LENGTH = 256;
   unsigned char buffer[LENGTH];
@@ -903,3 +1417,467 @@ struct term Elixir2EGuestEnv_read_0() {
   int pos = 0;
   return borsh_deserialize_term(buffer, &pos);
 }
+#endif
+
+// External Term Format
+
+enum etf_tag {
+  ETF_VERSION = 131,
+  ETF_DIST_HEADER = 68,
+  ETF_ATOM_CACHE_REF = 82,
+  ETF_SMALL_INTEGER = 97,
+  ETF_INTEGER = 98,
+  ETF_ATOM = 100,
+  ETF_SMALL_TUPLE = 104,
+  ETF_LARGE_TUPLE = 105,
+  ETF_NIL = 106,
+  ETF_STRING = 107,
+  ETF_LIST = 108,
+  ETF_BINARY = 109,
+  ETF_SMALL_BIG = 110,
+  ETF_SMALL_ATOM = 115,
+  ETF_MAP = 116,
+  ETF_ATOM_UTF8 = 118,
+  ETF_SMALL_ATOM_UTF8 = 119,
+  ETF_BIT_BINARY = 77
+};
+
+// Atoms announced by distribution headers, indexed by segment and internal
+// index, which later headers may refer to without repeating their text
+EX2C_THREAD_LOCAL struct term etf_atom_cache[2048];
+
+// Deepest nesting of tuples, lists and maps accepted by the decoder, which
+// bounds its use of the C stack
+#ifndef EX2C_ETF_MAX_DEPTH
+#define EX2C_ETF_MAX_DEPTH 1024
+#endif
+
+// Decoded terms point into the input, which must therefore outlive them
+
+struct etf_decoder {
+  const unsigned char *input;
+  size_t size;
+  size_t pos;
+  // Atoms referenced by the distribution header preceding the term
+  struct term atom_refs[255];
+  uint32_t atom_refs_size;
+  // Number of enclosing terms, since nested terms are decoded recursively
+  uint32_t depth;
+};
+
+bool etf_get_bytes(struct etf_decoder *d, size_t n, const unsigned char **bytes) {
+  if(n > d->size - d->pos) return false;
+  *bytes = d->input + d->pos;
+  d->pos += n;
+  return true;
+}
+
+bool etf_get_u8(struct etf_decoder *d, uint32_t *value) {
+  const unsigned char *bytes;
+  if(!etf_get_bytes(d, 1, &bytes)) return false;
+  *value = bytes[0];
+  return true;
+}
+
+bool etf_get_u16(struct etf_decoder *d, uint32_t *value) {
+  const unsigned char *bytes;
+  if(!etf_get_bytes(d, 2, &bytes)) return false;
+  *value = (uint32_t) bytes[0] << 8 | bytes[1];
+  return true;
+}
+
+bool etf_get_u32(struct etf_decoder *d, uint32_t *value) {
+  const unsigned char *bytes;
+  if(!etf_get_bytes(d, 4, &bytes)) return false;
+  *value = (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | (uint32_t) bytes[2] << 8 | bytes[3];
+  return true;
+}
+
+// Every element takes at least one byte, which bounds the allocations that
+// a malformed length can cause
+bool etf_check_count(struct etf_decoder *d, uint32_t count) {
+  return count <= d->size - d->pos;
+}
+
+bool etf_decode_atom(struct etf_decoder *d, uint32_t length, bool latin1, struct term *t) {
+  const unsigned char *bytes;
+  if(!etf_get_bytes(d, length, &bytes)) return false;
+  char *value = (char *) bytes;
+  // Latin-1 text outside of ASCII has to be re-encoded as UTF-8
+  uint32_t extra = 0;
+  if(latin1) {
+    for(uint32_t i = 0; i < length; i++) extra += bytes[i] >> 7;
+  }
+  if(extra) {
+    value = (char *) term_malloc(length + extra);
+    for(uint32_t i = 0, j = 0; i < length; i++) {
+      if(bytes[i] < 0x80) {
+        value[j++] = bytes[i];
+      } else {
+        value[j++] = 0xC0 | bytes[i] >> 6;
+        value[j++] = 0x80 | (bytes[i] & 0x3F);
+      }
+    }
+  }
+#ifdef EX2C_HASHCONS
+  // The table outlives the input, so the text is copied before being interned
+  struct term atom = make_atom(length + extra, value);
+  struct hashcons_entry *entry = hashcons_find(&atom);
+  if(!entry->used) {
+    if(!extra) {
+      atom.atom.value = (char *) term_malloc(length);
+      memcpy(atom.atom.value, bytes, length);
+    }
+    hashcons_insert(entry, atom);
+  }
+  *t = entry->term;
+#else
+  *t = make_atom(length + extra, value);
+#endif
+  return true;
+}
+
+bool etf_decode_dist_header(struct etf_decoder *d) {
+  uint32_t count;
+  if(!etf_get_u8(d, &count)) return false;
+  d->atom_refs_size = count;
+  if(count == 0) return true;
+  // One flag nibble per reference followed by one for the header itself
+  const unsigned char *flags;
+  if(!etf_get_bytes(d, count / 2 + 1, &flags)) return false;
+  bool long_atoms = (flags[count / 2] >> (count % 2 ? 4 : 0)) & 1;
+  for(uint32_t i = 0; i < count; i++) {
+    uint32_t nibble = (flags[i / 2] >> (i % 2 ? 4 : 0)) & 0xF;
+    uint32_t index, length;
+    if(!etf_get_u8(d, &index)) return false;
+    index |= (nibble & 7) << 8;
+    if(nibble & 8) {
+      if(!(long_atoms ? etf_get_u16(d, &length) : etf_get_u8(d, &length))) return false;
+      const unsigned char *bytes;
+      if(!etf_get_bytes(d, length, &bytes)) return false;
+      // Cached atoms outlive the message that announced them
+      char *value = (char *) malloc(length);
+      memcpy(value, bytes, length);
+      etf_atom_cache[index] = make_atom(length, value);
+    } else if(etf_atom_cache[index].type != ATOM) {
+      return false;
+    }
+    d->atom_refs[i] = etf_atom_cache[index];
+  }
+  return true;
+}
+
+bool etf_decode_term(struct etf_decoder *d, struct term *t);
+
+bool etf_decode_value(struct etf_decoder *d, struct term *t) {
+  uint32_t tag, length, value;
+  const unsigned char *bytes;
+  if(!etf_get_u8(d, &tag)) return false;
+  switch(tag) {
+  case ETF_ATOM_CACHE_REF:
+    if(!etf_get_u8(d, &value) || value >= d->atom_refs_size) return false;
+    *t = d->atom_refs[value];
+    return true;
+  case ETF_SMALL_INTEGER:
+    if(!etf_get_u8(d, &value)) return false;
+    *t = make_small(value);
+    return true;
+  case ETF_INTEGER:
+    if(!etf_get_u32(d, &value)) return false;
+    *t = make_small((int32_t) value);
+    return true;
+  case ETF_SMALL_BIG: {
+    // Only integers that fit in a small are supported
+    uint32_t sign;
+    if(!etf_get_u8(d, &length) || !etf_get_u8(d, &sign) || !etf_get_bytes(d, length, &bytes)) return false;
+    uint64_t magnitude = 0;
+    for(uint32_t i = length; i > 0; i--) {
+      if(magnitude >> 32) return false;
+      magnitude = magnitude << 8 | bytes[i - 1];
+    }
+    if(magnitude > (sign ? (uint64_t) INT32_MAX + 1 : (uint64_t) INT32_MAX)) return false;
+    *t = make_small(sign ? (int32_t) -(int64_t) magnitude : (int32_t) magnitude);
+    return true;
+  } case ETF_ATOM:
+    return etf_get_u16(d, &length) && etf_decode_atom(d, length, true, t);
+  case ETF_SMALL_ATOM:
+    return etf_get_u8(d, &length) && etf_decode_atom(d, length, true, t);
+  case ETF_ATOM_UTF8:
+    return etf_get_u16(d, &length) && etf_decode_atom(d, length, false, t);
+  case ETF_SMALL_ATOM_UTF8:
+    return etf_get_u8(d, &length) && etf_decode_atom(d, length, false, t);
+  case ETF_SMALL_TUPLE:
+  case ETF_LARGE_TUPLE: {
+    if(!(tag == ETF_SMALL_TUPLE ? etf_get_u8(d, &length) : etf_get_u32(d, &length))) return false;
+    if(!etf_check_count(d, length)) return false;
+    // Decode the elements in place rather than copying them into the tuple
+    struct term *values = (struct term *) term_malloc(length * sizeof(struct term));
+    for(uint32_t i = 0; i < length; i++) {
+      if(!etf_decode_term(d, &values[i])) return false;
+    }
+    t->type = TUPLE;
+    t->tuple.length = length;
+    t->tuple.values = values;
+    return true;
+  } case ETF_NIL:
+    *t = make_nil();
+    return true;
+  case ETF_STRING:
+  case ETF_LIST: {
+    bool string = tag == ETF_STRING;
+    if(!(string ? etf_get_u16(d, &length) : etf_get_u32(d, &length))) return false;
+    if(!etf_check_count(d, length)) return false;
+    if(string && !etf_get_bytes(d, length, &bytes)) return false;
+    // Allocate the heads and tails of the whole spine at once and fill it
+    // iteratively so that long lists do not exhaust the C stack
+    struct term *cells = (struct term *) term_malloc(2 * length * sizeof(struct term));
+    struct term *cell = t;
+    for(uint32_t i = 0; i < length; i++) {
+      cell->type = LIST;
+      cell->list.head = &cells[2 * i];
+      cell->list.tail = &cells[2 * i + 1];
+      if(string) *cell->list.head = make_small(bytes[i]);
+      else if(!etf_decode_term(d, cell->list.head)) return false;
+      cell = cell->list.tail;
+    }
+    if(string) {
+      *cell = make_nil();
+      return true;
+    }
+    return etf_decode_term(d, cell);
+  } case ETF_BINARY:
+    if(!etf_get_u32(d, &length) || !etf_get_bytes(d, length, &bytes)) return false;
+    t->type = BITSTRING;
+    t->bitstring.length = length * 8;
+    t->bitstring.bytes = (unsigned char *) bytes;
+    return true;
+  case ETF_BIT_BINARY: {
+    uint32_t bits;
+    if(!etf_get_u32(d, &length) || !etf_get_u8(d, &bits) || !etf_get_bytes(d, length, &bytes)) return false;
+    if(length == 0 || bits == 0 || bits > 8) return false;
+    t->type = BITSTRING;
+    t->bitstring.length = (length - 1) * 8 + bits;
+    t->bitstring.bytes = (unsigned char *) bytes;
+    return true;
+  } case ETF_MAP: {
+    if(!etf_get_u32(d, &length) || !etf_check_count(d, length)) return false;
+    struct term *keys = (struct term *) malloc(2 * length * sizeof(struct term));
+    struct term *values = keys + length;
+    bool ok = true;
+    for(uint32_t i = 0; ok && i < length; i++) {
+      ok = etf_decode_term(d, &keys[i]) && etf_decode_term(d, &values[i]);
+    }
+    // Encoded maps never repeat a key, as binary_to_term checks too
+    ok = ok && !has_duplicate_keys(keys, length);
+    if(ok) *t = put_map_assoc_nofail(make_map(), keys, values, length);
+    free(keys);
+    return ok;
+  } default:
+    // Floats, big integers, funs, pids, ports, references and compressed
+    // terms are not supported
+    return false;
+  }
+}
+
+bool etf_decode_term(struct etf_decoder *d, struct term *t) {
+  if(d->depth == EX2C_ETF_MAX_DEPTH) return false;
+  d->depth++;
+  bool ok = etf_decode_value(d, t);
+  d->depth--;
+  return ok;
+}
+
+// Decode a whole encoded term, optionally preceded by a distribution header
+bool etf_decode(const unsigned char *input, size_t size, struct term *t) {
+  struct etf_decoder d;
+  d.input = input;
+  d.size = size;
+  d.pos = 0;
+  d.atom_refs_size = 0;
+  d.depth = 0;
+  uint32_t version;
+  if(!etf_get_u8(&d, &version) || version != ETF_VERSION) return false;
+  if(d.pos < d.size && d.input[d.pos] == ETF_DIST_HEADER) {
+    d.pos++;
+    if(!etf_decode_dist_header(&d)) return false;
+  }
+  return etf_decode_term(&d, t) && d.pos == d.size;
+}
+
+// Terms are encoded in a single pass into a buffer that doubles as needed
+
+struct etf_buffer {
+  unsigned char *bytes;
+  size_t size;
+  size_t capacity;
+};
+
+unsigned char *etf_reserve(struct etf_buffer *b, size_t n) {
+  if(b->size + n > b->capacity) {
+    size_t capacity = b->capacity ? 2 * b->capacity : 64;
+    while(capacity < b->size + n) capacity *= 2;
+    b->bytes = (unsigned char *) term_realloc(b->bytes, b->capacity, capacity);
+    b->capacity = capacity;
+  }
+  unsigned char *bytes = b->bytes + b->size;
+  b->size += n;
+  return bytes;
+}
+
+void etf_put_u8(struct etf_buffer *b, uint32_t value) {
+  *etf_reserve(b, 1) = value;
+}
+
+void etf_put_u16(struct etf_buffer *b, uint32_t value) {
+  unsigned char *bytes = etf_reserve(b, 2);
+  bytes[0] = value >> 8;
+  bytes[1] = value;
+}
+
+void etf_put_u32(struct etf_buffer *b, uint32_t value) {
+  unsigned char *bytes = etf_reserve(b, 4);
+  bytes[0] = value >> 24;
+  bytes[1] = value >> 16;
+  bytes[2] = value >> 8;
+  bytes[3] = value;
+}
+
+void etf_put_bytes(struct etf_buffer *b, const void *bytes, size_t n) {
+  if(n) memcpy(etf_reserve(b, n), bytes, n);
+}
+
+bool etf_encode_term(struct etf_buffer *b, const struct term *t) {
+  switch(t->type) {
+  case NIL:
+    etf_put_u8(b, ETF_NIL);
+    return true;
+  case LIST: {
+    // Measure the spine and check whether it is a proper list of bytes
+    uint32_t length = 0;
+    bool string = true;
+    const struct term *cell = t;
+    for(; cell->type == LIST; cell = cell->list.tail, length++) {
+      const struct term *head = cell->list.head;
+      string = string && head->type == SMALL && head->small.value >= 0 && head->small.value <= 255;
+    }
+    if(string && cell->type == NIL && length <= UINT16_MAX) {
+      etf_put_u8(b, ETF_STRING);
+      etf_put_u16(b, length);
+      unsigned char *bytes = etf_reserve(b, length);
+      cell = t;
+      for(uint32_t i = 0; i < length; i++, cell = cell->list.tail) bytes[i] = cell->list.head->small.value;
+      return true;
+    }
+    etf_put_u8(b, ETF_LIST);
+    etf_put_u32(b, length);
+    cell = t;
+    for(; cell->type == LIST; cell = cell->list.tail) {
+      if(!etf_encode_term(b, cell->list.head)) return false;
+    }
+    return etf_encode_term(b, cell);
+  } case SMALL:
+    if(t->small.value >= 0 && t->small.value <= 255) {
+      etf_put_u8(b, ETF_SMALL_INTEGER);
+      etf_put_u8(b, t->small.value);
+    } else {
+      etf_put_u8(b, ETF_INTEGER);
+      etf_put_u32(b, t->small.value);
+    }
+    return true;
+  case ATOM:
+    if(t->atom.length <= UINT8_MAX) {
+      etf_put_u8(b, ETF_SMALL_ATOM_UTF8);
+      etf_put_u8(b, t->atom.length);
+    } else {
+      etf_put_u8(b, ETF_ATOM_UTF8);
+      etf_put_u16(b, t->atom.length);
+    }
+    etf_put_bytes(b, t->atom.value, t->atom.length);
+    return true;
+  case TUPLE:
+    if(t->tuple.length <= UINT8_MAX) {
+      etf_put_u8(b, ETF_SMALL_TUPLE);
+      etf_put_u8(b, t->tuple.length);
+    } else {
+      etf_put_u8(b, ETF_LARGE_TUPLE);
+      etf_put_u32(b, t->tuple.length);
+    }
+    for(int i = 0; i < t->tuple.length; i++) {
+      if(!etf_encode_term(b, &t->tuple.values[i])) return false;
+    }
+    return true;
+  case FUN:
+    return false;
+  case BITSTRING: {
+    uint32_t byte_size = bit_to_byte_size(t->bitstring.length);
+    uint32_t bits = t->bitstring.length % 8;
+    etf_put_u8(b, bits ? ETF_BIT_BINARY : ETF_BINARY);
+    etf_put_u32(b, byte_size);
+    if(bits) etf_put_u8(b, bits);
+    etf_put_bytes(b, t->bitstring.bytes, byte_size);
+    // The unused low bits of the last byte must be zero
+    if(bits) b->bytes[b->size - 1] &= 0xFF << (8 - bits);
+    return true;
+  } case MAP:
+    etf_put_u8(b, ETF_MAP);
+    etf_put_u32(b, map_size(*t));
+    for(const struct map *map = t->map; map; map = map->tail) {
+      if(!etf_encode_term(b, &map->key) || !etf_encode_term(b, &map->value)) return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+bool etf_encode(const struct term *t, struct etf_buffer *b) {
+  etf_put_u8(b, ETF_VERSION);
+  return etf_encode_term(b, t);
+}
+
+struct term erlang_term_to_binary_1() {
+  struct etf_buffer buffer = { NULL, 0, 0 };
+  if(!etf_encode(&xs[0], &buffer)) {
+    raise_error(make_atom(6, "badarg"), "argument 1: functions cannot be encoded");
+  }
+  // The result owns the buffer rather than a copy of it
+  struct term t;
+  t.type = BITSTRING;
+  t.bitstring.length = buffer.size * 8;
+  t.bitstring.bytes = buffer.bytes;
+  return t;
+}
+
+struct term erlang_binary_to_term_1() {
+  struct term t;
+  if(xs[0].type != BITSTRING || xs[0].bitstring.length % 8 ||
+     !etf_decode(xs[0].bitstring.bytes, xs[0].bitstring.length / 8, &t)) {
+    raise_error(make_atom(6, "badarg"), "argument 1: invalid or unsupported external representation of a term");
+  }
+  return t;
+}
+
+#ifdef EX2C_ETF
+
+// Capacity of the buffer that the guest environment is read into
+#ifndef EX2C_ENV_BUFFER_SIZE
+#define EX2C_ENV_BUFFER_SIZE 4096
+#endif
+
+struct term Elixir2EGuestEnv_commit_1() {
+  struct term t = erlang_term_to_binary_1();
+  env_commit(t.bitstring.bytes, t.bitstring.length / 8);
+  return t;
+}
+
+struct term Elixir2EGuestEnv_read_0() {
+  // Decoded terms point into the buffer, so it is never released
+  unsigned char *buffer = (unsigned char *) term_malloc(EX2C_ENV_BUFFER_SIZE);
+  uintptr_t size = env_read(buffer, EX2C_ENV_BUFFER_SIZE);
+  struct term t;
+  if(size > EX2C_ENV_BUFFER_SIZE || !etf_decode(buffer, size, &t)) {
+    raise_error(make_atom(6, "badarg"), "env_read/2 returned an invalid external representation of a term");
+  }
+  return t;
+}
+
+#endif
@@ -5,7 +5,8 @@ defmodule Ex2c do
 
   import Bitwise
 
-  defstruct counter: 0, declarations: []
+  defstruct counter: 0, declarations: [], comments: true, specifiers: %{}, instrument: false, profile: nil, lambdas: %{}, unboxed: %{},
+            max_concurrency: nil
 
   # Generate a new symbol
 
@@ -21,6 +22,12 @@ defmodule Ex2c do
 
   def declarator({:type_name, _, decl}), do: decl
 
+  # Describe the given BEAM code in a C comment unless comments are disabled
+
+  def comment_stmts(code, state = %__MODULE__{}) do
+    if state.comments, do: [{:comment_stmt, Kernel.inspect(code)}], else: []
+  end
+
   def beam_label_to_c(lbl), do: "L#{lbl}"
 
   def escape_identifier(id), do: String.replace(String.replace(String.replace(String.replace(String.replace(String.replace(String.replace(String.replace(String.replace(id, "-", "2D"), ".", "2E"), "/", "2F"), "+", "2B"), "*", "2A"), "=", "3D"), ":", "3A"), "^", "5E"), "$", "24")
@@ -37,7 +44,7 @@ defmodule Ex2c do
 
   def labbel_arity({:extfunc, _module, _function, arity}), do: arity
 
-  def compile_goto({:f, 0}), do: {:expr_stmt, {:call_expr, {:symbol_expr, "abort"}, []}}
+  def compile_goto({:f, 0}), do: {:expr_stmt, {:call_expr, {:symbol_expr, "badarg"}, []}}
 
   def compile_goto(label), do: {:goto_stmt, compile_label(label)}
 
@@ -113,49 +120,69 @@ defmodule Ex2c do
 
   def compile_operand(a) when is_integer(a), do: {:literal_expr, a}
 
+  def compile_operand({:unboxed, call, i}), do: {:subscript_expr, {:symbol_expr, "ret#{call}"}, {:literal_expr, i}}
+
+  # Construct a fun capturing the given operands through a runtime constructor
+
+  def compile_make_fun(constructor, code, label, dst, env, state = %__MODULE__{}) do
+    cfunc_decl =
+      {:function_declarator,
+       {:pointer_declarator, {:identifier_declarator, ""}}, []}
+    cfunc_type = {:type_name, "struct term", cfunc_decl}
+    cfun_id = compile_label(label)
+    {comment_stmts(code, state) ++ [
+     {:expr_stmt, {:binary_expr, :=, compile_operand(dst), {:call_expr, {:symbol_expr, constructor}, [
+       {:cast_expr, cfunc_type, {:address_of_expr, {:symbol_expr, cfun_id}}},
+       {:literal_expr, cfun_id},
+       {:literal_expr, String.length(cfun_id)},
+       {:literal_expr, label_arity(label)},
+       {:literal_expr, length(env)},
+       {:compound_literal_expr, "struct term []", Enum.map(env, fn x -> {:expr_initializer, compile_operand(x)} end)}]}}}], state}
+  end
+
   def compile_code(code = {:select_val, _selector, fail, {:list, []}}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)}, {:goto_stmt, compile_label(fail)}], state}
+    {comment_stmts(code, state) ++ [{:goto_stmt, compile_label(fail)}], state}
   end
 
   def compile_code(code = {:select_val, selector, fail, {:list, [value, label | rest]}}, state = %__MODULE__{}) do
     {rest, state} = compile_code({:select_val, selector, fail, {:list, rest}}, state)
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:if_stmt, {:binary_expr, :==, {:call_expr, {:symbol_expr, "cmp_exact"}, [compile_operand(selector), compile_operand(value)]}, {:literal_expr, 0}},
       [{:goto_stmt, compile_label(label)}], rest}], state}
   end
 
   def compile_code(code = {:jump, label}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)}, {:goto_stmt, compile_label(label)}], state}
+    {comment_stmts(code, state) ++ [{:goto_stmt, compile_label(label)}], state}
   end
 
   def compile_code(code = {:label, lbl}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)}, {:label_stmt, beam_label_to_c(lbl)}], state}
+    {comment_stmts(code, state) ++ [{:label_stmt, beam_label_to_c(lbl)}], state}
   end
 
   def compile_code(code = {:allocate, need_stack, _live}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)}, {:expr_stmt, {:binary_expr, :"-=", {:symbol_expr, "E"}, {:literal_expr, need_stack + 1}}}], state}
+    {comment_stmts(code, state) ++ [{:expr_stmt, {:call_expr, {:symbol_expr, "allocate"}, [{:literal_expr, need_stack + 1}]}}], state}
   end
 
   def compile_code(code = {:allocate_heap, need_stack, _heap_need, _live}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)}, {:expr_stmt, {:binary_expr, :"-=", {:symbol_expr, "E"}, {:literal_expr, need_stack + 1}}}], state}
+    {comment_stmts(code, state) ++ [{:expr_stmt, {:call_expr, {:symbol_expr, "allocate"}, [{:literal_expr, need_stack + 1}]}}], state}
   end
 
   def compile_code(code = {:deallocate, deallocate}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)}, {:expr_stmt, {:binary_expr, :"+=", {:symbol_expr, "E"}, {:literal_expr, deallocate + 1}}}], state}
+    {comment_stmts(code, state) ++ [{:expr_stmt, {:binary_expr, :"+=", {:symbol_expr, "E"}, {:literal_expr, deallocate + 1}}}], state}
   end
 
   def compile_code(code = {:move, src, dest}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)}, {:expr_stmt, {:binary_expr, :=, compile_operand(dest), compile_operand(src)}}], state}
+    {comment_stmts(code, state) ++ [{:expr_stmt, {:binary_expr, :=, compile_operand(dest), compile_operand(src)}}], state}
   end
 
   def compile_code(code = {:test, name, label, arguments}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:if_stmt, {:not_expr, {:call_expr, {:symbol_expr, Atom.to_string(name)}, Enum.map(arguments, &Ex2c.compile_operand/1)}},
       [compile_goto(label)], []}], state}
   end
 
   def compile_code(code = {:test, name, label, src, {:list, arguments}}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
       {:if_stmt, {:not_expr, {:call_expr, {:symbol_expr, Atom.to_string(name)}, [
        compile_operand(src),
        {:literal_expr, length(arguments)},
@@ -170,7 +197,7 @@ defmodule Ex2c do
       {:address_of_expr, compile_operand(tail)}
     ]
     ccall = {:expr_stmt, {:call_expr, {:symbol_expr, Atom.to_string(name)}, cargs}}
-    {[{:comment_stmt, Kernel.inspect(code)}, ccall], state}
+    {comment_stmts(code, state) ++ [ccall], state}
   end
 
   def compile_code(code = {name = :get_hd, source, head}, state = %__MODULE__{}) do
@@ -179,7 +206,7 @@ defmodule Ex2c do
       {:address_of_expr, compile_operand(head)}
     ]
     ccall = {:expr_stmt, {:call_expr, {:symbol_expr, Atom.to_string(name)}, cargs}}
-    {[{:comment_stmt, Kernel.inspect(code)}, ccall], state}
+    {comment_stmts(code, state) ++ [ccall], state}
   end
 
   def compile_code(code = {name = :get_tl, source, tail}, state = %__MODULE__{}) do
@@ -188,7 +215,7 @@ defmodule Ex2c do
       {:address_of_expr, compile_operand(tail)}
     ]
     ccall = {:expr_stmt, {:call_expr, {:symbol_expr, Atom.to_string(name)}, cargs}}
-    {[{:comment_stmt, Kernel.inspect(code)}, ccall], state}
+    {comment_stmts(code, state) ++ [ccall], state}
   end
 
   def compile_code(code = {name = :put_list, head, tail, dest}, state = %__MODULE__{}) do
@@ -198,7 +225,7 @@ defmodule Ex2c do
       {:address_of_expr, compile_operand(dest)}
     ]
     ccall = {:expr_stmt, {:call_expr, {:symbol_expr, Atom.to_string(name)}, cargs}}
-    {[{:comment_stmt, Kernel.inspect(code)}, ccall], state}
+    {comment_stmts(code, state) ++ [ccall], state}
   end
 
   def compile_code(code = {name = :get_tl, src, tail}, state = %__MODULE__{}) do
@@ -207,70 +234,70 @@ defmodule Ex2c do
       {:address_of_expr, compile_operand(tail)}
     ]
     ccall = {:expr_stmt, {:call_expr, {:symbol_expr, Atom.to_string(name)}, cargs}}
-    {[{:comment_stmt, Kernel.inspect(code)}, ccall], state}
+    {comment_stmts(code, state) ++ [ccall], state}
   end
 
   def compile_code(code = {:call, arity, label}, state = %__MODULE__{}) do
     ccall = {:call_expr, {:symbol_expr, compile_label(label)}, []}
-    {[{:comment_stmt, Kernel.inspect(code)}, {:expr_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
+    {comment_stmts(code, state) ++ [{:expr_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
   end
 
   def compile_code(code = {:call_only, arity, label}, state = %__MODULE__{}) do
     ccall = {:call_expr, {:symbol_expr, compile_label(label)}, []}
-    {[{:comment_stmt, Kernel.inspect(code)}, {:return_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
+    {comment_stmts(code, state) ++ [{:return_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
   end
 
   def compile_code(code = {:call_ext_only, arity, label}, state = %__MODULE__{}) do
     ccall = {:call_expr, {:symbol_expr, compile_label(label)}, []}
-    {[{:comment_stmt, Kernel.inspect(code)}, {:return_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
+    {comment_stmts(code, state) ++ [{:return_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
   end
 
   def compile_code(code = {:call_ext, arity, label}, state = %__MODULE__{}) do
     ccall = {:call_expr, {:symbol_expr, compile_label(label)}, []}
-    {[{:comment_stmt, Kernel.inspect(code)}, {:expr_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
+    {comment_stmts(code, state) ++ [{:expr_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
   end
 
   def compile_code(code = {:call_last, arity, label, deallocate}, state = %__MODULE__{}) do
     ccall = {:call_expr, {:symbol_expr, compile_label(label)}, []}
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:expr_stmt, {:binary_expr, :"+=", {:symbol_expr, "E"}, {:literal_expr, deallocate + 1}}},
      {:return_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
   end
 
   def compile_code(code = {:call_ext_last, arity, label, deallocate}, state = %__MODULE__{}) do
     ccall = {:call_expr, {:symbol_expr, compile_label(label)}, []}
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
       {:expr_stmt, {:binary_expr, :"+=", {:symbol_expr, "E"}, {:literal_expr, deallocate + 1}}},
       {:return_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ccall}}], state}
   end
 
   def compile_code(code = {:gc_bif, name, label, _live, arguments, reg}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:if_stmt, {:not_expr, {:call_expr, {:symbol_expr, bif_name_to_c(name)}, Enum.map(arguments, &Ex2c.compile_operand/1) ++ [{:address_of_expr, compile_operand(reg)}]}},
       [compile_goto(label)], []}], state}
   end
 
   def compile_code(code = {:bif, name, label, arguments, reg}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:if_stmt, {:not_expr, {:call_expr, {:symbol_expr, bif_name_to_c(name)}, Enum.map(arguments, &Ex2c.compile_operand/1) ++ [{:address_of_expr, compile_operand(reg)}]}},
       [compile_goto(label)], []}], state}
   end
 
   def compile_code(code = {:init_yregs, {:list, regs}}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)} |
-     Enum.map(regs, fn x -> {:expr_stmt, {:binary_expr, :=, compile_operand(x), compile_operand(nil)}} end)], state}
+    {comment_stmts(code, state) ++
+     Enum.map(regs, fn x -> {:expr_stmt, {:binary_expr, :=, compile_operand(x), compile_operand(nil)}} end), state}
   end
 
   def compile_code(code = {:swap, op1, op2}, state = %__MODULE__{}) do
     {state, tmp} = gen_sym(state)
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:declaration_stmt, "struct term", [{{:identifier_declarator, tmp}, compile_operand(op1)}]},
      {:expr_stmt, {:binary_expr, :=, compile_operand(op1), compile_operand(op2)}},
      {:expr_stmt, {:binary_expr, :=, compile_operand(op2), {:symbol_expr, tmp}}}], state}
   end
 
   def compile_code(code = {:get_tuple_element, src, idx, dst}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
     {:expr_stmt, {:binary_expr, :=, compile_operand(dst), {:subscript_expr, {:member_access_expr, {:member_access_expr, compile_operand(src), "tuple"}, "values"}, {:literal_expr, idx}}}}], state}
   end
 
@@ -278,28 +305,82 @@ defmodule Ex2c do
     ccall = {:call_expr, {:symbol_expr, "make_tuple"}, [
       {:literal_expr, length(elts)},
       {:compound_literal_expr, "struct term []", Enum.map(elts, fn x -> {:expr_initializer, compile_operand(x)} end)}]}
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:expr_stmt, {:binary_expr, :=, compile_operand(dst), ccall}}], state}
   end
 
   def compile_code(code = :return, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)}, {:return_stmt, compile_operand({:x, 0})}], state}
+    {comment_stmts(code, state) ++ [{:return_stmt, compile_operand({:x, 0})}], state}
   end
 
-  def compile_code(code = {:make_fun3, label, _index, _unique, dst, {:list, env}}, state = %__MODULE__{}) do
-    cfunc_decl =
-      {:function_declarator,
-       {:pointer_declarator, {:identifier_declarator, ""}}, []}
-    cfunc_type = {:type_name, "struct term", cfunc_decl}
-    cfun_id = compile_label(label)
-    {[{:comment_stmt, Kernel.inspect(code)},
-     {:expr_stmt, {:binary_expr, :=, compile_operand(dst), {:call_expr, {:symbol_expr, "make_fun"}, [
-       {:cast_expr, cfunc_type, {:address_of_expr, {:symbol_expr, cfun_id}}},
-       {:literal_expr, cfun_id},
-       {:literal_expr, String.length(cfun_id)},
-       {:literal_expr, label_arity(label)},
-       {:literal_expr, length(env)},
-       {:compound_literal_expr, "struct term []", Enum.map(env, fn x -> {:expr_initializer, compile_operand(x)} end)}]}}}], state}
+  def compile_code(code = {:make_fun3, label, _index, _unique, dst, {:list, env}}, state = %__MODULE__{}),
+    do: compile_make_fun("make_fun", code, label, dst, env, state)
+
+  # The environment of a fun that does not escape its block is left in the
+  # automatic storage of the function creating it
+
+  def compile_code(code = {:make_fun3_scoped, label, _index, _unique, dst, {:list, env}}, state = %__MODULE__{}),
+    do: compile_make_fun("make_fun_scoped", code, label, dst, env, state)
+
+  # Terms that do not escape their block keep their parts in the automatic
+  # storage of the function creating them
+
+  def compile_code(code = {:put_tuple2_scoped, dst, {:list, elts}}, state = %__MODULE__{}) do
+    ccall = {:call_expr, {:symbol_expr, "make_tuple_scoped"}, [
+      {:literal_expr, length(elts)},
+      {:compound_literal_expr, "struct term []", Enum.map(elts, fn x -> {:expr_initializer, compile_operand(x)} end)}]}
+    {comment_stmts(code, state) ++ [{:expr_stmt, {:binary_expr, :=, compile_operand(dst), ccall}}], state}
+  end
+
+  def compile_code(code = {:put_list_scoped, head, tail, dest}, state = %__MODULE__{}) do
+    cargs = [
+      {:compound_literal_expr, "struct term []", [{:expr_initializer, compile_operand(head)}, {:expr_initializer, compile_operand(tail)}]},
+      {:address_of_expr, compile_operand(dest)}
+    ]
+    {comment_stmts(code, state) ++ [{:expr_stmt, {:call_expr, {:symbol_expr, "put_list_scoped"}, cargs}}], state}
+  end
+
+  # Return the elements of a tuple in the argument registers, through a
+  # temporary since they may be read from those registers
+
+  def compile_code(code = {:put_tuple2_unboxed, {:list, elts}}, state = %__MODULE__{}) do
+    {state, tmp} = gen_sym(state)
+    n = length(elts)
+    celts = Enum.map(elts, fn x -> {:expr_initializer, compile_operand(x)} end)
+    {comment_stmts(code, state) ++
+     [{:declaration_stmt, "struct term", [{{:array_declarator, {:identifier_declarator, tmp}, {:literal_expr, n}}, {:initializer_list_initializer, celts}}]}] ++
+     for(i <- 0..(n - 1), do: {:expr_stmt, {:binary_expr, :=, compile_operand({:x, i}), {:subscript_expr, {:symbol_expr, tmp}, {:literal_expr, i}}}}), state}
+  end
+
+  # Keep the elements returned by an unboxed call apart from the registers
+  # that the following instructions overwrite
+
+  def compile_code(code = {:call_unboxed, _arity, label, n, call}, state = %__MODULE__{}) do
+    ccall = {:call_expr, {:symbol_expr, unboxed_label(label)}, []}
+    celts = for i <- 0..(n - 1), do: {:expr_initializer, compile_operand({:x, i})}
+    {comment_stmts(code, state) ++ [
+     {:expr_stmt, ccall},
+     {:declaration_stmt, "struct term", [{{:array_declarator, {:identifier_declarator, "ret#{call}"}, {:literal_expr, n}}, {:initializer_list_initializer, celts}}]}], state}
+  end
+
+  # The unboxed result of a call is known to be a tuple of the right size
+
+  def compile_code(code = {:unboxed_test, _instr}, state = %__MODULE__{}), do: {comment_stmts(code, state), state}
+
+  # Call a fun whose code is known statically, passing its environment
+  # without a loop or an indirect call
+
+  def compile_code(code = {:call_fun_direct, arity, label, num_free, func}, state = %__MODULE__{}) do
+    {state, tmp} = gen_sym(state)
+    env = {:member_access_expr, {:member_access_expr, compile_operand(func), "fun"}, "env"}
+    cenv =
+      for i <- 0..(num_free - 1)//1 do
+        {:expr_stmt, {:binary_expr, :=, compile_operand({:x, arity + i}), {:subscript_expr, {:symbol_expr, tmp}, {:literal_expr, i}}}}
+      end
+    {comment_stmts(code, state) ++
+     [{:declaration_stmt, "struct term", [{{:pointer_declarator, {:identifier_declarator, tmp}}, env}]}] ++
+     cenv ++
+     [{:expr_stmt, {:binary_expr, :=, compile_operand({:x, 0}), {:call_expr, {:symbol_expr, compile_label(label)}, []}}}], state}
   end
 
   def compile_code(code = {:call_fun, arity}, state = %__MODULE__{}) do
@@ -315,7 +396,7 @@ defmodule Ex2c do
       {:function_declarator,
        {:pointer_declarator, {:identifier_declarator, ""}}, []}
     cfunc_type = {:type_name, "struct term", cfunc_decl}
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:declaration_stmt, "struct term", [{{:identifier_declarator, tmp}, compile_operand({:x, arity})}]},
      {:for_stmt, {:declaration_stmt, "int", [{{:identifier_declarator, counter}, {:literal_expr, 0}}]}, {:binary_expr, :<, counter_symbol, num_free}, {:postfix_expr, :++, counter_symbol},
       [{:expr_stmt, {:binary_expr, :=, {:subscript_expr, xs, {:binary_expr, :+, counter_symbol, {:literal_expr, arity}}}, {:subscript_expr, env, counter_symbol}}}]},
@@ -335,7 +416,7 @@ defmodule Ex2c do
       {:function_declarator,
        {:pointer_declarator, {:identifier_declarator, ""}}, []}
     cfunc_type = {:type_name, "struct term", cfunc_decl}
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:declaration_stmt, "struct term", [{{:identifier_declarator, tmp}, compile_operand(func)}]},
      {:for_stmt, {:declaration_stmt, "int", [{{:identifier_declarator, counter}, {:literal_expr, 0}}]}, {:binary_expr, :<, counter_symbol, num_free}, {:postfix_expr, :++, counter_symbol},
       [{:expr_stmt, {:binary_expr, :=, {:subscript_expr, xs, {:binary_expr, :+, counter_symbol, {:literal_expr, arity}}}, {:subscript_expr, env, counter_symbol}}}]},
@@ -345,7 +426,7 @@ defmodule Ex2c do
   def compile_code(code = {:trim, n, _remaining}, state = %__MODULE__{}) do
     n_literal = {:literal_expr, n}
     e_symbol = {:symbol_expr, "E"}
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
      {:expr_stmt, {:binary_expr, :=, {:subscript_expr, e_symbol, n_literal}, {:subscript_expr, e_symbol, {:literal_expr, 0}}}},
      {:expr_stmt, {:binary_expr, :"+=", e_symbol, n_literal}}], state}
   end
@@ -359,7 +440,7 @@ defmodule Ex2c do
 
   def compile_code(code = {:put_map_assoc, label, src, dest, live, {:list, rest}}, state = %__MODULE__{}) do
     {keys, values} = unweave(rest)
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
       {:if_stmt, {:not_expr, {:call_expr, {:symbol_expr, "put_map_assoc"}, [
        compile_operand(src),
        {:address_of_expr, compile_operand(dest)},
@@ -369,19 +450,21 @@ defmodule Ex2c do
        [compile_goto(label)], []}], state}
   end
 
-  def compile_code(code = {:line, _number}, state = %__MODULE__{}), do: {[{:comment_stmt, Kernel.inspect(code)}], state}
+  def compile_code(code = {:line, _number}, state = %__MODULE__{}), do: {comment_stmts(code, state), state}
 
-  def compile_code(code = {:func_info, _module, _func, _arity}, state = %__MODULE__{}), do: {[{:comment_stmt, Kernel.inspect(code)}], state}
+  def compile_code(code = {:func_info, _module, _func, _arity}, state = %__MODULE__{}) do
+    {comment_stmts(code, state) ++ [{:expr_stmt, {:call_expr, {:symbol_expr, "function_clause"}, []}}], state}
+  end
 
-  def compile_code(code = {:test_heap, _need, _live}, state = %__MODULE__{}), do: {[{:comment_stmt, Kernel.inspect(code)}], state}
+  def compile_code(code = {:test_heap, _need, _live}, state = %__MODULE__{}), do: {comment_stmts(code, state), state}
 
   def compile_code(code = {:case_end, op}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
       {:expr_stmt, {:call_expr, {:symbol_expr, "case_end"}, [Ex2c.compile_operand(op)]}}], state}
   end
 
   def compile_code(code = {:badmatch, op}, state = %__MODULE__{}) do
-    {[{:comment_stmt, Kernel.inspect(code)},
+    {comment_stmts(code, state) ++ [
       {:expr_stmt, {:call_expr, {:symbol_expr, "badmatch"}, [Ex2c.compile_operand(op)]}}], state}
   end
 
@@ -389,257 +472,1025 @@ defmodule Ex2c do
     %__MODULE__{state | declarations: [statement | state.declarations]}
   end
 
-  def compile_function({module, {:function, name, arity, entry, code}}, state) do
-    cfunc_decl =
-      {:function_declarator,
-       {:identifier_declarator, compile_label({module, name, arity})}, []}
-    cfunc_type = {:type_name, "struct term", cfunc_decl}
-    {cfunc_body, state} = Enum.flat_map_reduce(code, state, &Ex2c.compile_code/2)
-    state = emit_declaration(state, {:declaration_stmt, "struct term", [{cfunc_decl, nil}]})
-    {[{:comment_stmt, Kernel.inspect({:function, name, arity, entry, []})},
-     {:function_stmt, specifier(cfunc_type), cfunc_decl, cfunc_body}], state}
+  # Collect the registers occurring in the given operands
+
+  def registers(reg = {:x, _}), do: [reg]
+
+  def registers(reg = {:y, _}), do: [reg]
+
+  def registers(node) when is_tuple(node), do: registers(Tuple.to_list(node))
+
+  def registers(nodes) when is_list(nodes), do: Enum.flat_map(nodes, &Ex2c.registers/1)
+
+  def registers(_leaf), do: []
+
+  def argument_registers(arity), do: for(i <- 0..(arity - 1)//1, do: {:x, i})
+
+  # Escape analysis of the funs, tuples and list cells created by a function.
+  # The registers holding each term are tracked until the end of its block,
+  # and a term escapes once it is captured, passed, stored, returned, or still
+  # held when control may leave the block. Destructuring a tracked term is not
+  # an escape. Calls through a tracked fun are resolved statically, as are
+  # calls through external fun literals.
+
+  def escape_terms(acc, regs) do
+    terms =
+      Enum.reduce(regs, acc.terms, fn reg, terms ->
+        case Map.fetch(acc.regs, reg) do
+          {:ok, id} when is_map_key(terms, id) -> Map.update!(terms, id, &%{&1 | escaped: true})
+          _ -> terms
+        end
+      end)
+    %{acc | terms: terms}
   end
 
-  def compile_bytes(beam) do
-    {:beam_file, module, _labeled_exports, _attributes, _compile_info, code} = :beam_disasm.file(beam)
-    state = %__MODULE__{}
-    {program, state} = Enum.flat_map_reduce(code, state, fn x, acc -> Ex2c.compile_function({module, x}, acc) end)
-    program_string = program_to_string(state.declarations ++ program)
-    "#include \"ex2crt.h\"\n#{program_string}"
+  def untrack_terms(acc, regs), do: %{acc | regs: Map.drop(acc.regs, regs)}
+
+  def track_term(acc, dst, index, term) do
+    %{acc | regs: Map.put(acc.regs, dst, index), terms: Map.put(acc.terms, index, Map.put(term, :escaped, false))}
   end
 
-  def compile_file(path) do
-    {:ok, beam} = File.read(path)
-    compile_bytes(beam)
+  # Calls clobber the argument registers, and tail calls leave the function
+
+  def analyze_call(acc, arity, tail) do
+    acc = escape_terms(acc, argument_registers(arity))
+    if tail,
+      do: %{acc | regs: %{}},
+      else: %{acc | regs: Map.filter(acc.regs, fn {reg, _id} -> elem(reg, 0) == :y end)}
   end
 
-  # Convert C expression to string
+  def untrack_frame(acc), do: %{acc | regs: Map.filter(acc.regs, fn {reg, _id} -> elem(reg, 0) == :x end)}
+
+  def tracked_operand({:tr, reg, _type}), do: reg
+
+  def tracked_operand(operand), do: operand
 
-  def cexpr_to_string({:literal_expr, value}) when is_number(value),
-    do: "#{value}"
+  # Record the fun called through a register, if it is known
 
-  def cexpr_to_string({:literal_expr, value}) when is_boolean(value),
-    do: "#{value}"
+  def analyze_fun_call(acc, index, func) do
+    case Map.fetch(acc.regs, tracked_operand(func)) do
+      {:ok, id = {:external, _mfa}} -> %{acc | calls: Map.put(acc.calls, index, id)}
+      {:ok, id} -> if acc.terms[id].kind == :fun, do: %{acc | calls: Map.put(acc.calls, index, id)}, else: acc
+      :error -> acc
+    end
+  end
 
-  def cexpr_to_string({:literal_expr, value}) when is_binary(value),
-    do: "\"#{value}\""
+  # Reading the parts of a tracked term only overwrites its destinations
 
-  def cexpr_to_string({:symbol_expr, value}) when is_binary(value),
-    do: "#{value}"
+  def analyze_destructure(acc, src, dsts) do
+    regs = registers(src) -- [tracked_operand(src)]
+    untrack_terms(escape_terms(acc, regs), dsts)
+  end
 
-  def cexpr_to_string({:address_of_expr, expr}),
-    do: "&#{cexpr_to_string(expr)}"
+  def analyze_instr({{:label, _lbl}, _index}, acc), do: %{escape_terms(acc, Map.keys(acc.regs)) | regs: %{}}
 
-  def cexpr_to_string({:indirection_expr, expr}),
-    do: "*#{cexpr_to_string(expr)}"
+  def analyze_instr({{:make_fun3, label, _index, _unique, dst, {:list, env}}, index}, acc) do
+    acc = untrack_terms(escape_terms(acc, registers(env)), [dst])
+    track_term(acc, dst, index, %{kind: :fun, label: label, num_free: length(env)})
+  end
 
-  def cexpr_to_string({:binary_expr, op, expr1, expr2}),
-    do: "(#{cexpr_to_string(expr1)} #{op} #{cexpr_to_string(expr2)})"
+  def analyze_instr({{:put_tuple2, dst, {:list, elts}}, index}, acc) do
+    acc = untrack_terms(escape_terms(acc, registers(elts)), [dst])
+    track_term(acc, dst, index, %{kind: :tuple})
+  end
 
-  def cexpr_to_string({:postfix_expr, op, expr}),
-    do: "(#{cexpr_to_string(expr)}#{op})"
+  def analyze_instr({{:put_list, head, tail, dst}, index}, acc) do
+    acc = untrack_terms(escape_terms(acc, registers([head, tail])), [dst])
+    track_term(acc, dst, index, %{kind: :list})
+  end
 
-  def cexpr_to_string({:prefix_expr, op, expr}),
-    do: "(#{op}#{cexpr_to_string(expr)})"
+  def analyze_instr({{:get_tuple_element, src, _idx, dst}, _index}, acc), do: analyze_destructure(acc, src, [dst])
 
-  def cexpr_to_string({:not_expr, expr}),
-    do: "!#{cexpr_to_string(expr)}"
+  def analyze_instr({{:get_list, src, head, tail}, _index}, acc), do: analyze_destructure(acc, src, [head, tail])
 
-  def cexpr_to_string({:subscript_expr, expr1, expr2}),
-    do: "#{cexpr_to_string(expr1)}[#{cexpr_to_string(expr2)}]"
+  def analyze_instr({{:get_hd, src, head}, _index}, acc), do: analyze_destructure(acc, src, [head])
 
-  def cexpr_to_string({:member_access_expr, expr, member}),
-    do: "#{cexpr_to_string(expr)}.#{member}"
+  def analyze_instr({{:get_tl, src, tail}, _index}, acc), do: analyze_destructure(acc, src, [tail])
 
-  def cexpr_to_string({:cast_expr, typename, expr}) do
-    "((#{specifier(typename)} #{declarator_to_string(declarator(typename))}) #{cexpr_to_string(expr)})"
+  def analyze_instr({{:move, {:literal, fun}, dst}, _index}, acc) when is_function(fun) do
+    acc = untrack_terms(acc, [dst])
+    if Function.info(fun, :type) == {:type, :external} do
+      info = Function.info(fun)
+      %{acc | regs: Map.put(acc.regs, dst, {:external, {info[:module], info[:name], info[:arity]}})}
+    else
+      acc
+    end
   end
 
-  def cexpr_to_string({:call_expr, reference, args}) do
-    str = cexpr_to_string(reference) <> "("
+  def analyze_instr({{:move, src, dst}, _index}, acc) do
+    id = Map.get(acc.regs, tracked_operand(src))
+    acc = untrack_terms(acc, [dst])
+    if id == nil, do: acc, else: %{acc | regs: Map.put(acc.regs, dst, id)}
+  end
 
-    str =
-      case args do
-        [arg0 | rest] ->
-          for arg <- rest, reduce: str <> cexpr_to_string(arg0) do
-            str -> str <> ", " <> cexpr_to_string(arg)
-          end
+  def analyze_instr({{:call_fun, arity}, index}, acc), do: analyze_call(analyze_fun_call(acc, index, {:x, arity}), arity, false)
 
-        [] ->
-          str
-      end
+  def analyze_instr({{:call_fun2, _tag, arity, func}, index}, acc), do: analyze_call(analyze_fun_call(acc, index, func), arity, false)
+
+  def analyze_instr({{op, arity, _label}, _index}, acc) when op in [:call, :call_ext], do: analyze_call(acc, arity, false)
+
+  def analyze_instr({{op, arity, _label}, _index}, acc) when op in [:call_only, :call_ext_only], do: analyze_call(acc, arity, true)
+
+  def analyze_instr({{op, arity, _label, _deallocate}, _index}, acc) when op in [:call_last, :call_ext_last],
+    do: analyze_call(acc, arity, true)
+
+  def analyze_instr({{:apply, arity}, _index}, acc), do: analyze_call(acc, arity + 2, false)
+
+  def analyze_instr({{:apply_last, arity, _deallocate}, _index}, acc), do: analyze_call(acc, arity + 2, true)
+
+  def analyze_instr({:return, _index}, acc), do: %{escape_terms(acc, [{:x, 0}]) | regs: %{}}
 
-    str <> ")"
+  # A new or released frame holds no tracked terms, while trimming renumbers
+  # the terms that it holds
+
+  def analyze_instr({{op, _need_stack, _live}, _index}, acc) when op in [:allocate, :allocate_zero],
+    do: untrack_frame(acc)
+
+  def analyze_instr({{op, _need_stack, _heap_need, _live}, _index}, acc) when op in [:allocate_heap, :allocate_heap_zero],
+    do: untrack_frame(acc)
+
+  def analyze_instr({{:deallocate, _n}, _index}, acc), do: untrack_frame(acc)
+
+  def analyze_instr({{:trim, _n, _remaining}, _index}, acc) do
+    frame = for {reg = {:y, _}, _id} <- acc.regs, do: reg
+    untrack_frame(escape_terms(acc, frame))
   end
 
-  def cexpr_to_string({:compound_literal_expr, type, initializer_list}) do
-    "(" <> type <> ") " <> cinitialization_to_string({:initializer_list_initializer, initializer_list})
+  # Any other use of a term is an escape, and so is a possible jump to
+  # another block while it is held
+
+  def analyze_instr({instr, _index}, acc) do
+    regs = registers(instr)
+    acc = untrack_terms(escape_terms(acc, regs), regs)
+    if branches?(instr), do: escape_terms(acc, Map.keys(acc.regs)), else: acc
   end
 
-  # Convert C initialization to string
+  def branches?({:f, lbl}) when lbl > 0, do: true
+
+  def branches?(node) when is_tuple(node), do: branches?(Tuple.to_list(node))
+
+  def branches?(nodes) when is_list(nodes), do: Enum.any?(nodes, &Ex2c.branches?/1)
+
+  def branches?(_leaf), do: false
+
+  # Rewrite the terms of a function that do not escape and the calls whose
+  # fun is known into their cheaper forms
+
+  def devirtualize(module, code, lambdas) do
+    acc = code |> Enum.with_index() |> Enum.reduce(%{regs: %{}, terms: %{}, calls: %{}}, &Ex2c.analyze_instr/2)
+    scoped? = fn index -> not acc.terms[index].escaped end
+    known = fn arity, id -> known_fun(acc.terms, arity, id) end
 
-  def cinitialization_to_string({:expr_initializer, expr}), do: cexpr_to_string(expr)
+    for {instr, index} <- Enum.with_index(code) do
+      case instr do
+        {:make_fun3, label, fun_index, unique, dst, env} ->
+          if scoped?.(index), do: {:make_fun3_scoped, label, fun_index, unique, dst, env}, else: instr
 
-  def cinitialization_to_string({:initializer_list_initializer, []}), do: "{}"
+        {:put_tuple2, dst, elts} ->
+          if scoped?.(index), do: {:put_tuple2_scoped, dst, elts}, else: instr
 
-  def cinitialization_to_string({:initializer_list_initializer, [init0 | rest]}) do
-    str = "{" <> cinitialization_to_string(init0)
+        {:put_list, head, tail, dst} ->
+          if scoped?.(index), do: {:put_list_scoped, head, tail, dst}, else: instr
 
-    str =
-      for init <- rest, reduce: str do
-        str -> str <> ", " <> cinitialization_to_string(init)
+        {:call_fun, arity} ->
+          with id when id != nil <- acc.calls[index], {label, num_free} <- known.(arity, id),
+            do: {:call_fun_direct, arity, label, num_free, {:x, arity}}, else: (_ -> instr)
+
+        {:call_fun2, tag, arity, func} ->
+          # A fun index tag means that the fun is always the given lambda
+          id =
+            case Map.fetch(lambdas, {module, tag}) do
+              {:ok, {label, num_free}} -> {:lambda, label, num_free}
+              :error -> acc.calls[index]
+            end
+          with id when id != nil <- id, {label, num_free} <- known.(arity, id),
+            do: {:call_fun_direct, arity, label, num_free, tracked_operand(func)}, else: (_ -> instr)
+
+        _ ->
+          instr
       end
+    end
+  end
+
+  # The code and number of free variables of a known fun, provided that it
+  # accepts the given number of arguments
+
+  def known_fun(_terms, arity, {:external, mfa = {_module, _name, arity}}), do: {mfa, 0}
+
+  def known_fun(_terms, _arity, {:external, _mfa}), do: nil
+
+  def known_fun(_terms, arity, {:lambda, label, num_free}),
+    do: if(label_arity(label) == arity + num_free, do: {label, num_free})
+
+  def known_fun(terms, arity, index) do
+    %{label: label, num_free: num_free} = terms[index]
+    known_fun(terms, arity, {:lambda, label, num_free})
+  end
 
-    str <> "}"
+  # Map the lambdas of a module to their code and number of free variables
+
+  def lambda_table(module, code) do
+    for {:function, _name, _arity, _entry, body} <- code, {:make_fun3, label, index, _unique, _dst, {:list, env}} <- body,
+      into: %{}, do: {{module, index}, {label, length(env)}}
   end
 
-  def cinitialization_to_string({:member_designator_initializer, designators, initializer}) do
-    str =
-      for des <- designators, reduce: "" do
-        str -> str <> "." <> des
+  # Wrap the unboxed form of a function for the callers expecting a tuple
+
+  def compile_boxed(mfa, n, specifier, state = %__MODULE__{}) do
+    cfunc_decl = {:function_declarator, {:identifier_declarator, compile_label(mfa)}, []}
+    celts = for i <- 0..(n - 1), do: {:expr_initializer, compile_operand({:x, i})}
+    ctuple = {:call_expr, {:symbol_expr, "make_tuple"}, [{:literal_expr, n}, {:compound_literal_expr, "struct term []", celts}]}
+    state = emit_declaration(state, {:declaration_stmt, specifier, [{cfunc_decl, nil}]})
+    {[{:function_stmt, specifier, cfunc_decl, [
+      {:expr_stmt, {:call_expr, {:symbol_expr, unboxed_label(mfa)}, []}},
+      {:return_stmt, {:binary_expr, :=, compile_operand({:x, 0}), ctuple}}]}], state}
+  end
+
+  def compile_function({module, {:function, name, arity, entry, code}}, state) do
+    mfa = {module, name, arity}
+    cfun_id = compile_label(mfa)
+    specifier = Map.get(state.specifiers, mfa, "struct term")
+    code = devirtualize(module, code, state.lambdas) |> unbox_calls(state.unboxed) |> func_info_last(entry)
+
+    {code, cfunc_decl, cfunc_type} =
+      case Map.fetch(state.unboxed, mfa) do
+        {:ok, _n} ->
+          cfunc_decl = {:function_declarator, {:identifier_declarator, unboxed_label(mfa)}, []}
+          specifier = if String.contains?(specifier, "static"), do: specifier, else: "static " <> specifier
+          {unbox_returns(code), cfunc_decl, {:type_name, specifier, cfunc_decl}}
+
+        :error ->
+          cfunc_decl = {:function_declarator, {:identifier_declarator, cfun_id}, []}
+          {code, cfunc_decl, {:type_name, specifier, cfunc_decl}}
+      end
+    {cfunc_body, state} =
+      cond do
+        state.instrument -> compile_instrumented(cfun_id, code, state)
+        state.profile -> compile_profiled(Map.get(state.profile, cfun_id, %{}), code, state)
+        true -> Enum.flat_map_reduce(code, state, &Ex2c.compile_code/2)
+      end
+    state = emit_declaration(state, {:declaration_stmt, specifier(cfunc_type), [{cfunc_decl, nil}]})
+
+    {cboxed, state} =
+      case Map.fetch(state.unboxed, mfa) do
+        {:ok, n} -> compile_boxed(mfa, n, specifier, state)
+        :error -> {[], state}
       end
-    str <> " = " <> cinitialization_to_string(initializer)
+
+    {comment_stmts({:function, name, arity, entry, []}, state) ++
+     [{:function_stmt, specifier(cfunc_type), cfunc_decl, cfunc_body}] ++ cboxed, state}
   end
 
-  # Convert C declaration to string
+  # Move the func_info instruction, which raises function_clause when no clause
+  # matches, from before the entry point to after the body so that the C
+  # function starts at its entry point
 
-  def declarator_to_string({:identifier_declarator, ident})
-      when is_binary(ident),
-      do: "#{ident}"
+  def func_info_last(code, entry) do
+    {prologue, body} = Enum.split_while(code, &(&1 != {:label, entry}))
+    body ++ prologue
+  end
 
-  def declarator_to_string({:pointer_declarator, decl}),
-    do: "(*#{declarator_to_string(decl)})"
+  # Instructions that may allocate term storage, either directly or in the
+  # functions that they call
 
-  def declarator_to_string({:array_declarator, decl, expr}),
-    do: "(#{declarator_to_string(decl)}[#{cexpr_to_string(expr)}])"
+  @allocating_instructions [:put_list, :put_tuple2, :make_fun3, :put_map_assoc, :put_map_exact, :gc_bif, :bif,
+                            :badmatch, :case_end, :call, :call_only, :call_last, :call_ext, :call_ext_only,
+                            :call_ext_last, :call_fun, :call_fun2, :call_fun_direct, :call_unboxed]
 
-  def declarator_to_string({:function_declarator, declarator, params}) do
-    str = declarator_to_string(declarator) <> "("
+  # Instructions that jump to labels of their function when they fail or
+  # select an alternative
 
-    case params do
-      [{spec0, decl0} | rest] ->
-        str = str <> spec0 <> " " <> declarator_to_string(decl0)
+  @branching_instructions [:test, :select_val, :gc_bif, :bif]
 
-        str =
-          for {spec, decl} <- rest, reduce: str do
-            str ->
-              str <> ", " <> spec <> " " <> declarator_to_string(decl)
-          end
+  def profile_site({:label, lbl}, _index), do: beam_label_to_c(lbl)
 
-        str <> ")"
+  # Moving a literal constructs it afresh, unless it is an immediate
+  def profile_site({:move, {:literal, literal}, _dst}, index)
+      when (is_list(literal) and literal != []) or is_tuple(literal) or is_bitstring(literal) or
+             is_function(literal) or (is_map(literal) and literal != %{}),
+      do: "move@#{index}"
 
-      [] ->
-        str <> ")"
-    end
+  def profile_site(instr, index)
+      when is_tuple(instr) and (elem(instr, 0) in @allocating_instructions or elem(instr, 0) in @branching_instructions),
+      do: "#{elem(instr, 0)}@#{index}"
+
+  def profile_site(_instr, _index), do: nil
+
+  def branching?(instr), do: is_tuple(instr) and elem(instr, 0) in @branching_instructions
+
+  def compile_profile_at(sites_id, index) do
+    site_ptr = {:address_of_expr, {:subscript_expr, {:symbol_expr, sites_id}, {:literal_expr, index}}}
+    {:expr_stmt, {:call_expr, {:symbol_expr, "profile_at"}, [site_ptr]}}
   end
 
-  # Convert C initializer to string
+  # Count the jumps taken by a branching instruction, naming each edge after
+  # the instruction and its target
 
-  def initializer_to_string(nil), do: ""
+  def instrument_edges(stmts, site, sites_id, acc) do
+    Enum.flat_map_reduce(stmts, acc, fn
+      goto = {:goto_stmt, target}, {sites, size} ->
+        {[compile_profile_at(sites_id, size), goto], {["#{site}:#{target}" | sites], size + 1}}
 
-  def initializer_to_string(init), do: " = " <> cexpr_to_string(init)
+      {:if_stmt, condition, cons, alt}, acc ->
+        {cons, acc} = instrument_edges(cons, site, sites_id, acc)
+        {alt, acc} = instrument_edges(alt, site, sites_id, acc)
+        {[{:if_stmt, condition, cons, alt}], acc}
 
-  # Convert C statement to string
+      stmt, acc ->
+        {[stmt], acc}
+    end)
+  end
 
-  def stmt_to_string({:if_stmt, condition, cons, [{:comment_stmt, _comment}, alt = {:if_stmt, _, _, _}]}) do
-    str = "if(" <> cexpr_to_string(condition) <> ") {\n"
+  # Compile the code of a function so that it counts its entries, the
+  # executions of each block, of each instruction that may allocate or branch
+  # and of each branch taken, and charges allocations to the instruction
+  # executing. The counters are emitted as declarations so that they precede
+  # every function.
+
+  def compile_instrumented(cfun_id, code, state = %__MODULE__{}) do
+    sites_id = "profile_" <> cfun_id
+    info_id = sites_id <> "_info"
+
+    {cbody, {state, sites, _size}} =
+      Enum.flat_map_reduce(Enum.with_index(code), {state, ["entry"], 1}, fn {instr, index}, {state, sites, size} ->
+        {stmts, state} = compile_code(instr, state)
+
+        case profile_site(instr, index) do
+          nil ->
+            {stmts, {state, sites, size}}
+
+          site ->
+            cprofile = compile_profile_at(sites_id, size)
+            {stmts, {sites, size}} =
+              if branching?(instr),
+                do: instrument_edges(stmts, site, sites_id, {[site | sites], size + 1}),
+                else: {stmts, {[site | sites], size + 1}}
+            # Blocks are counted once their label has been reached
+            stmts = if match?({:label, _}, instr), do: stmts ++ [cprofile], else: [cprofile | stmts]
+            {stmts, {state, sites, size}}
+        end
+      end)
 
-    str =
-      for stmt <- cons, reduce: str do
-        str -> str <> stmt_to_string(stmt)
+    csites =
+      for site <- Enum.reverse(sites) do
+        {:initializer_list_initializer, [{:expr_initializer, {:literal_expr, cfun_id}}, {:expr_initializer, {:literal_expr, site}}]}
       end
 
-    str <> "} else " <> stmt_to_string(alt)
+    cinfo =
+      {:initializer_list_initializer, [{:expr_initializer, {:symbol_expr, sites_id}}, {:expr_initializer, {:literal_expr, length(csites)}}]}
+
+    csites_decl = {:array_declarator, {:identifier_declarator, sites_id}, {:literal_expr, length(csites)}}
+    # Declarations are emitted in reverse, so the sites precede the function information
+    state = emit_declaration(state, {:declaration_stmt, "struct profile_function", [{{:identifier_declarator, info_id}, cinfo}]})
+    state = emit_declaration(state, {:declaration_stmt, "struct profile_site", [{csites_decl, {:initializer_list_initializer, csites}}]})
+    {[{:expr_stmt, {:call_expr, {:symbol_expr, "profile_enter"}, [{:address_of_expr, {:symbol_expr, info_id}}]}} | cbody], state}
+  end
+
+  # Branches taken with at least this probability are hinted to the C compiler
+
+  @branch_bias 0.9
+
+  def expect(condition, taken, total) when total > 0 and taken >= @branch_bias * total,
+    do: {:call_expr, {:symbol_expr, "__builtin_expect"}, [condition, {:literal_expr, 1}]}
+
+  def expect(condition, taken, total) when total > 0 and taken <= (1 - @branch_bias) * total,
+    do: {:call_expr, {:symbol_expr, "__builtin_expect"}, [condition, {:literal_expr, 0}]}
+
+  def expect(condition, _taken, _total), do: condition
+
+  # Hint the conditional jumps of a branching instruction executed `total`
+  # times, given how often each of its targets was taken. The alternatives of
+  # a chain are only reached by the executions that the previous tests let
+  # through.
+
+  def hint_branches(stmts, taken, total) do
+    Enum.map(stmts, fn
+      {:if_stmt, condition, cons = [{:goto_stmt, target}], alt} ->
+        count = Map.get(taken, target, 0)
+        {:if_stmt, expect(condition, count, total), cons, hint_branches(alt, taken, total - count)}
+
+      stmt ->
+        stmt
+    end)
+  end
+
+  # Test the most frequently selected values first. The values of a
+  # select_val are distinct, so their order does not affect its meaning.
+
+  def order_arms({:select_val, selector, fail, {:list, arms}}, taken) do
+    arms =
+      arms
+      |> Enum.chunk_every(2)
+      |> Enum.sort_by(fn [_value, label] -> Map.get(taken, compile_label(label), 0) end, :desc)
+      |> Enum.concat()
+    {:select_val, selector, fail, {:list, arms}}
   end
 
-  def stmt_to_string({:if_stmt, condition, cons, alt}) do
-    str = "if(" <> cexpr_to_string(condition) <> ") {\n"
+  def order_arms(instr, _taken), do: instr
+
+  # Compile the code of a function using the counts recorded for it by an
+  # instrumented build
 
-    str =
-      for stmt <- cons, reduce: str do
-        str -> str <> stmt_to_string(stmt)
+  def compile_profiled(counts, code, state = %__MODULE__{}) do
+    edges =
+      for {site, count} <- counts, [branch, target] <- [String.split(site, ":", parts: 2)], reduce: %{} do
+        acc -> Map.update(acc, branch, %{target => count}, &Map.update(&1, target, count, fn x -> x + count end))
       end
 
-    if alt == [] do
-      str <> "}\n"
+    Enum.flat_map_reduce(Enum.with_index(code), state, fn {instr, index}, state ->
+      if branching?(instr) do
+        site = profile_site(instr, index)
+        taken = Map.get(edges, site, %{})
+        {stmts, state} = compile_code(order_arms(instr, taken), state)
+        {hint_branches(stmts, taken, Map.get(counts, site, 0)), state}
+      else
+        compile_code(instr, state)
+      end
+    end)
+  end
+
+  @doc """
+  Read a flat profile written by the runtime's `profile_dump` into the form
+  expected by the `:profile` option: a map from the C names of functions to
+  the counts of their sites.
+  """
+  def read_profile(path) do
+    path
+    |> File.stream!()
+    |> Stream.drop(1)
+    |> Enum.reduce(%{}, fn line, acc ->
+      [count, _bytes, qualified] = String.split(line)
+      [function, site] = String.split(qualified, ":", parts: 2)
+      count = String.to_integer(count)
+      Map.update(acc, function, %{site => count}, &Map.update(&1, site, count, fn x -> x + count end))
+    end)
+  end
+
+  # Functions that account for this share of the profiled work are hot
+
+  @hot_share 0.9
+
+  def function_weight(mfa, profile), do: profile |> Map.get(compile_label(mfa), %{}) |> Map.values() |> Enum.sum()
+
+  def hot_functions(mfas, profile) do
+    weighted = mfas |> Enum.map(&{&1, function_weight(&1, profile)}) |> Enum.filter(fn {_mfa, w} -> w > 0 end)
+    total = weighted |> Enum.map(fn {_mfa, w} -> w end) |> Enum.sum()
+
+    weighted
+    |> Enum.sort_by(fn {_mfa, w} -> w end, :desc)
+    |> Enum.reduce_while({[], 0}, fn {mfa, w}, {hot, acc} ->
+      if acc >= @hot_share * total, do: {:halt, {hot, acc}}, else: {:cont, {[mfa | hot], acc + w}}
+    end)
+    |> elem(0)
+    |> Enum.reverse()
+  end
+
+  # Lay the hot functions out together, heaviest first, and mark the
+  # functions that the profile never entered as cold so that the C compiler
+  # moves them out of the way
+
+  def layout_functions(functions, specifiers, nil), do: {functions, specifiers}
+
+  def layout_functions(functions, specifiers, profile) do
+    mfas = for {module, {:function, name, arity, _entry, _code}} <- functions, do: {module, name, arity}
+    rank = mfas |> hot_functions(profile) |> Enum.with_index() |> Map.new()
+
+    functions =
+      Enum.sort_by(functions, fn {module, {:function, name, arity, _entry, _code}} ->
+        Map.get(rank, {module, name, arity}, map_size(rank))
+      end)
+
+    specifiers =
+      for mfa <- mfas, into: specifiers do
+        specifier = Map.get(specifiers, mfa, "struct term")
+
+        cond do
+          Map.has_key?(rank, mfa) -> {mfa, "__attribute__((hot)) " <> specifier}
+          function_weight(mfa, profile) == 0 -> {mfa, "__attribute__((cold, noinline)) " <> String.replace(specifier, "inline ", "")}
+          true -> {mfa, specifier}
+        end
+      end
+
+    {functions, specifiers}
+  end
+
+  # Compile functions concurrently, merging their output in the given order
+  # so that the generated program does not depend on scheduling
+
+  def compile_functions(functions, state = %__MODULE__{}) do
+    fresh = %__MODULE__{state | declarations: []}
+
+    functions
+    |> Task.async_stream(&Ex2c.compile_function(&1, fresh), timeout: :infinity,
+         max_concurrency: state.max_concurrency || System.schedulers_online())
+    |> Enum.flat_map_reduce(state, fn {:ok, {stmts, fstate}}, acc ->
+      {stmts, %__MODULE__{acc | declarations: fstate.declarations ++ acc.declarations}}
+    end)
+  end
+
+  # Route term construction through the runtime's hash-consing table
+
+  def share_constructors({:symbol_expr, name}) when name in ["make_tuple", "make_list", "put_list"],
+    do: {:symbol_expr, name <> "_shared"}
+
+  def share_constructors(node) when is_tuple(node),
+    do: List.to_tuple(share_constructors(Tuple.to_list(node)))
+
+  def share_constructors(nodes) when is_list(nodes), do: Enum.map(nodes, &Ex2c.share_constructors/1)
+
+  def share_constructors(leaf), do: leaf
+
+  # Collect the modules whose functions are called or captured externally by
+  # the given code
+
+  def external_modules({:extfunc, module, _function, _arity}), do: [module]
+
+  # Fun literals refer to the C function of their module
+  def external_modules(fun) when is_function(fun) do
+    {:module, module} = Function.info(fun, :module)
+    [module]
+  end
+
+  def external_modules(node) when is_tuple(node), do: external_modules(Tuple.to_list(node))
+
+  def external_modules(nodes) when is_list(nodes), do: Enum.flat_map(nodes, &Ex2c.external_modules/1)
+
+  def external_modules(map) when is_map(map), do: external_modules(Map.to_list(map))
+
+  def external_modules(_leaf), do: []
+
+  @doc """
+  Compile the given BEAM bytes into the C declarations and function
+  definitions of its module, without the runtime include. Returns
+  `{module, declarations, program, dependencies}` where `dependencies` lists
+  the other modules whose functions are called. Accepts the same options as
+  `compile_bytes/2`.
+  """
+  def compile_module(beam, opts \\ []) do
+    {:beam_file, module, _labeled_exports, _attributes, _compile_info, code} = :beam_disasm.file(beam)
+    profile = Keyword.get(opts, :profile)
+    {functions, specifiers} = layout_functions(Enum.map(code, &{module, &1}), %{}, profile)
+
+    state = %__MODULE__{comments: Keyword.get(opts, :comments, true), instrument: Keyword.get(opts, :instrument, false),
+                        profile: profile, specifiers: specifiers, lambdas: lambda_table(module, code),
+                        unboxed: unboxed_table(module, code), max_concurrency: Keyword.get(opts, :max_concurrency)}
+    {program, state} = compile_functions(functions, state)
+    dependencies = external_modules(code) |> Enum.uniq() |> List.delete(module)
+
+    if Keyword.get(opts, :hashcons, false) do
+      {module, share_constructors(state.declarations), share_constructors(program), dependencies}
     else
-      str =
-        for stmt <- alt, reduce: str <> "} else {\n" do
-          str -> str <> stmt_to_string(stmt)
+      {module, state.declarations, program, dependencies}
+    end
+  end
+
+  @doc """
+  Compile the given BEAM bytes into C source. The following options are
+  supported:
+
+    * `:hashcons` - when `true`, tuples and lists are constructed through the
+      runtime's hash-consing table so that equal subterms share storage, and
+      `EX2C_HASHCONS` is defined so that deserialized terms are shared too.
+
+    * `:comments` - when `false`, the BEAM instructions are not reproduced as
+      comments in the generated C. Defaults to `true`.
+
+    * `:instrument` - when `true`, every function counts its entries, the
+      executions of its blocks and of its allocating instructions, and
+      `EX2C_PROFILE` is defined so that the runtime charges the bytes it
+      allocates to those instructions. The counters can be read with
+      `profile_snapshot`, cleared with `profile_reset` and written as a flat
+      profile with `profile_dump`, which also records how often each branch
+      was taken.
+
+    * `:profile` - the counts recorded by an instrumented build of the same
+      code, as returned by `read_profile/1`. Branches that are taken or
+      skipped at least 90% of the time are hinted with `__builtin_expect`,
+      the values of `select_val` are tested in decreasing order of frequency,
+      the functions accounting for 90% of the recorded work are marked `hot`
+      and laid out first, and the functions that were never entered are
+      marked `cold` and `noinline`.
+
+    * `:max_concurrency` - the number of functions compiled at once. Defaults
+      to the number of online schedulers. The output does not depend on it.
+
+    * `:etf` - when `true`, `EX2C_ETF` is defined so that the guest
+      environment is read and committed in the External Term Format, which
+      the BEAM produces with `:erlang.term_to_binary/1`, rather than in Borsh.
+  """
+  def compile_bytes(beam, opts \\ []) do
+    {_module, declarations, program, _dependencies} = compile_module(beam, opts)
+    translation_unit(declarations, program, opts)
+  end
+
+  def compile_file(path, opts \\ []) do
+    {:ok, beam} = File.read(path)
+    compile_bytes(beam, opts)
+  end
+
+  # Definitions configuring the runtime for the given compilation options
+
+  def prelude(opts) do
+    [if(Keyword.get(opts, :hashcons, false), do: "#define EX2C_HASHCONS\n", else: []),
+     if(Keyword.get(opts, :instrument, false), do: "#define EX2C_PROFILE\n", else: []),
+     if(Keyword.get(opts, :etf, false), do: "#define EX2C_ETF\n", else: [])]
+  end
+
+  # Assemble a complete translation unit around the runtime
+
+  def translation_unit(declarations, program, opts) do
+    IO.iodata_to_binary([prelude(opts), "#include \"ex2crt.h\"\n", program_to_iodata(declarations ++ program)])
+  end
+
+  # Collect the functions that the given code may call or capture
+
+  def function_references({:extfunc, module, function, arity}), do: [{module, function, arity}]
+
+  def function_references({:call, _arity, mfa = {_module, _function, _arity2}}), do: [mfa]
+
+  def function_references({:call_only, _arity, mfa = {_module, _function, _arity2}}), do: [mfa]
+
+  def function_references({:call_last, _arity, mfa = {_module, _function, _arity2}, _deallocate}), do: [mfa]
+
+  def function_references({:make_fun3, mfa = {_module, _function, _arity}, _index, _unique, _dst, _env}), do: [mfa]
+
+  def function_references(fun) when is_function(fun) do
+    fun_info = :erlang.fun_info(fun)
+    [{fun_info[:module], fun_info[:name], fun_info[:arity]}]
+  end
+
+  def function_references(node) when is_tuple(node), do: function_references(Tuple.to_list(node))
+
+  def function_references(nodes) when is_list(nodes), do: Enum.flat_map(nodes, &Ex2c.function_references/1)
+
+  def function_references(map) when is_map(map), do: function_references(Map.to_list(map))
+
+  def function_references(_leaf), do: []
+
+  # Compute the functions transitively reachable from the given entry points.
+  # Calls to functions outside of the given set are left to the runtime.
+
+  def reachable_functions(functions, entry_points), do: reachable_functions(functions, entry_points, MapSet.new())
+
+  def reachable_functions(_functions, [], visited), do: visited
+
+  def reachable_functions(functions, [mfa | rest], visited) do
+    case Map.fetch(functions, mfa) do
+      {:ok, {:function, _name, _arity, _entry, code}} ->
+        if MapSet.member?(visited, mfa) do
+          reachable_functions(functions, rest, visited)
+        else
+          reachable_functions(functions, function_references(code) ++ rest, MapSet.put(visited, mfa))
         end
 
-      str <> "}\n"
+      :error ->
+        reachable_functions(functions, rest, visited)
     end
   end
 
-  def stmt_to_string({:return_stmt, val}),
-    do: "return " <> cexpr_to_string(val) <> ";\n"
+  # A function is worth inlining if it is short and makes no calls of its own
 
-  def stmt_to_string({:comment_stmt, comment}),
-    do: "// " <> comment <> "\n"
+  @call_instructions [:call, :call_only, :call_last, :call_ext, :call_ext_only, :call_ext_last, :call_fun, :call_fun2, :apply, :apply_last]
 
-  def stmt_to_string({:expr_stmt, expr}),
-    do: cexpr_to_string(expr) <> ";\n"
+  def inline_candidate?({:function, _name, _arity, _entry, code}, threshold) do
+    length(code) <= threshold and
+      not Enum.any?(code, fn instr -> is_tuple(instr) and elem(instr, 0) in @call_instructions end)
+  end
 
-  def stmt_to_string({:for_stmt, init_stmt, cond_expr, expr_expr, body}) do
-    str = "for(" <> String.replace(stmt_to_string(init_stmt), "\n", " ") <> cexpr_to_string(cond_expr) <> "; " <> cexpr_to_string(expr_expr) <> ") {\n"
-    str =
-      for stmt <- body, reduce: str do
-        str -> str <> stmt_to_string(stmt)
-      end
-    str <> "}\n"
+  # A function returning small tuples can return their elements unboxed in
+  # the argument registers instead, provided that every return immediately
+  # follows the construction of a tuple of the same size in x0 and that its
+  # other exits raise exceptions. The boxed function then wraps the unboxed
+  # one for the callers that need the tuple itself.
+
+  @max_unboxed_arity 8
+
+  @raising_functions [{:erlang, :error, 1}, {:erlang, :error, 2}, {:erlang, :error, 3}, {:erlang, :exit, 1},
+                      {:erlang, :throw, 1}, {:erlang, :nif_error, 1}]
+
+  def unboxed_label(mfa), do: compile_label(mfa) <> "_unboxed"
+
+  def unboxed_arity({:function, _name, _arity, _entry, code}) do
+    {arities, _pending} =
+      Enum.flat_map_reduce(code, nil, fn
+        {:put_tuple2, {:x, 0}, {:list, elts}}, _pending -> {[], length(elts)}
+        {op, _n}, pending when op in [:deallocate, :line] -> {[], pending}
+        :return, pending -> {[pending], nil}
+        {:call_ext_only, _arity, {:extfunc, m, f, a}}, _pending when {m, f, a} in @raising_functions -> {[], nil}
+        {:call_ext_last, _arity, {:extfunc, m, f, a}, _n}, _pending when {m, f, a} in @raising_functions -> {[], nil}
+        instr, _pending when is_tuple(instr) and elem(instr, 0) in [:call_only, :call_last, :call_ext_only, :call_ext_last, :apply_last] -> {[nil], nil}
+        _instr, _pending -> {[], nil}
+      end)
+
+    case Enum.uniq(arities) do
+      [n] when is_integer(n) and n > 0 and n <= @max_unboxed_arity -> {:ok, n}
+      _ -> :error
+    end
   end
 
-  def stmt_to_string({:label_stmt, identifier})
-      when is_binary(identifier),
-      do: identifier <> ":\n"
+  def unboxed_table(module, code) do
+    for function = {:function, name, arity, _entry, _code} <- code, {:ok, n} <- [unboxed_arity(function)],
+      into: %{}, do: {{module, name, arity}, n}
+  end
 
-  def stmt_to_string({:goto_stmt, identifier})
-      when is_binary(identifier),
-      do: "goto " <> identifier <> ";\n"
-
-  def stmt_to_string({:declaration_stmt, spec, decls}) do
-    str = spec
-
-    case decls do
-      [{decl0, init0} | rest] ->
-        str =
-          str <>
-            " " <>
-            declarator_to_string(decl0) <> initializer_to_string(init0)
-
-        str =
-          for {decl, init} <- rest, reduce: str do
-            str ->
-              str <>
-                ", " <>
-                declarator_to_string(decl) <>
-                initializer_to_string(init)
-          end
+  # Leave the elements of the returned tuples in the argument registers
+
+  def unbox_returns(code) do
+    code
+    |> Enum.reverse()
+    |> Enum.map_reduce(false, fn
+      :return, _returning -> {:return, true}
+      instr = {op, _n}, returning when op in [:deallocate, :line] -> {instr, returning}
+      {:put_tuple2, {:x, 0}, elts}, true -> {{:put_tuple2_unboxed, elts}, false}
+      instr, _returning -> {instr, false}
+    end)
+    |> elem(0)
+    |> Enum.reverse()
+  end
 
-        str <> ";\n"
+  # Classify an instruction following an unboxed call: it either reads the
+  # returned tuple in a way that can use the unboxed elements, overwrites it,
+  # leaves it alone, or needs the tuple itself
 
-      [] ->
-        ";\n"
+  def unboxed_use(instr = {:get_tuple_element, src, i, dst}, call, n) when i < n do
+    cond do
+      tracked_operand(src) != {:x, 0} -> unboxed_use(instr)
+      tracked_operand(dst) == {:x, 0} -> {:done, {:move, {:unboxed, call, i}, dst}}
+      true -> {:continue, {:move, {:unboxed, call, i}, dst}}
     end
   end
 
-  def stmt_to_string({:function_stmt, spec, decl, body}) do
-    str = spec <> " " <> declarator_to_string(decl) <> " {\n"
+  def unboxed_use(instr = {:test, :is_tuple, _fail, [src]}, _call, _n),
+    do: if(tracked_operand(src) == {:x, 0}, do: {:continue, {:unboxed_test, instr}}, else: unboxed_use(instr))
 
-    str =
-      for stmt <- body, reduce: str do
-        str -> str <> stmt_to_string(stmt)
-      end
+  def unboxed_use(instr = {:test, :test_arity, _fail, [src, n]}, _call, n),
+    do: if(tracked_operand(src) == {:x, 0}, do: {:continue, {:unboxed_test, instr}}, else: unboxed_use(instr))
+
+  def unboxed_use(instr, _call, _n), do: unboxed_use(instr)
+
+  def unboxed_use({:line, _n}), do: {:continue, nil}
+
+  def unboxed_use({op, 0, _label}) when op in [:call, :call_ext], do: {:done, nil}
+
+  def unboxed_use(instr) do
+    cond do
+      instr == :return or match?({:label, _}, instr) or branches?(instr) -> :escape
+      is_tuple(instr) and elem(instr, 0) in @call_instructions -> :escape
+      {:x, 0} not in registers(instr) -> {:continue, nil}
+      true ->
+        case overwriting_x0(instr) do
+          {:ok, read} -> if {:x, 0} in registers(read), do: :escape, else: {:done, nil}
+          :error -> :escape
+        end
+    end
+  end
+
+  # The operands read by an instruction that overwrites x0
+
+  def overwriting_x0({:move, src, {:x, 0}}), do: {:ok, src}
+
+  def overwriting_x0({:get_tuple_element, src, _idx, {:x, 0}}), do: {:ok, src}
+
+  def overwriting_x0({:gc_bif, _name, _fail, _live, args, {:x, 0}}), do: {:ok, args}
+
+  def overwriting_x0({:bif, _name, _fail, args, {:x, 0}}), do: {:ok, args}
+
+  def overwriting_x0({op, {:x, 0}, elts}) when op in [:put_tuple2, :put_tuple2_scoped], do: {:ok, elts}
+
+  def overwriting_x0({op, head, tail, {:x, 0}}) when op in [:put_list, :put_list_scoped], do: {:ok, [head, tail]}
+
+  def overwriting_x0(_instr), do: :error
+
+  def unboxed_uses([], _call, _n), do: :escape
 
-    str <> "}\n"
+  def unboxed_uses([{instr, index} | rest], call, n) do
+    case unboxed_use(instr, call, n) do
+      :escape -> :escape
+      {:done, nil} -> []
+      {:done, replacement} -> [{index, replacement}]
+      {:continue, replacement} ->
+        with uses when is_list(uses) <- unboxed_uses(rest, call, n),
+          do: if(replacement, do: [{index, replacement} | uses], else: uses)
+    end
+  end
+
+  # Call the unboxed form of a function wherever its result is only
+  # destructured before being overwritten
+
+  def unbox_calls(code, unboxed) do
+    indexed = Enum.with_index(code)
+
+    rewrites =
+      Enum.reduce(indexed, %{}, fn
+        {{:call, arity, mfa}, index}, acc when is_map_key(unboxed, mfa) ->
+          case unboxed_uses(Enum.drop(indexed, index + 1), index, unboxed[mfa]) do
+            :escape -> acc
+            uses -> Map.merge(acc, Map.new([{index, {:call_unboxed, arity, mfa, unboxed[mfa], index}} | uses]))
+          end
+
+        _instr, acc ->
+          acc
+      end)
+
+    for {instr, index} <- indexed, do: Map.get(rewrites, index, instr)
   end
 
-  # Convert C program to string
+  @doc """
+  Compile the given BEAM modules into a single C translation unit containing
+  only the functions reachable from `entry_points`, a list of
+  `{module, function, arity}` tuples. Every other function is given internal
+  linkage so that the C compiler can inline it across module boundaries, and
+  short leaf functions are additionally marked `inline`. Accepts the options
+  of `compile_bytes/2` as well as:
+
+    * `:inline_threshold` - the largest number of BEAM instructions in a leaf
+      function that is marked `inline`. Defaults to 32.
+  """
+  def compile_program(beams, entry_points, opts \\ []) do
+    modules =
+      for beam <- beams do
+        {:beam_file, module, _labeled_exports, _attributes, _compile_info, code} = :beam_disasm.file(beam)
+        {module, code}
+      end
+
+    functions =
+      for {module, code} <- modules, function = {:function, name, arity, _entry, _code} <- code,
+        into: %{}, do: {{module, name, arity}, function}
+
+    for mfa <- entry_points, not Map.has_key?(functions, mfa) do
+      raise ArgumentError, "entry point #{Kernel.inspect(mfa)} is not defined by the given modules"
+    end
+
+    reachable = reachable_functions(functions, entry_points)
+    threshold = Keyword.get(opts, :inline_threshold, 32)
+
+    specifiers =
+      for mfa <- reachable, mfa not in entry_points, into: %{} do
+        if inline_candidate?(functions[mfa], threshold),
+          do: {mfa, "static inline struct term"},
+          else: {mfa, "static struct term"}
+      end
+
+    live =
+      for {module, code} <- modules, function = {:function, name, arity, _entry, _code} <- code,
+        MapSet.member?(reachable, {module, name, arity}), do: {module, function}
+
+    profile = Keyword.get(opts, :profile)
+    {live, specifiers} = layout_functions(live, specifiers, profile)
+
+    lambdas = for {module, code} <- modules, reduce: %{}, do: (acc -> Map.merge(acc, lambda_table(module, code)))
+    unboxed = for {module, code} <- modules, reduce: %{}, do: (acc -> Map.merge(acc, unboxed_table(module, code)))
 
-  def program_to_string(program) do
-    for stmt <- program, reduce: "" do
-      str -> str <> stmt_to_string(stmt)
+    state = %__MODULE__{comments: Keyword.get(opts, :comments, true), instrument: Keyword.get(opts, :instrument, false),
+                        profile: profile, specifiers: specifiers, lambdas: lambdas, unboxed: unboxed,
+                        max_concurrency: Keyword.get(opts, :max_concurrency)}
+    {program, state} = compile_functions(live, state)
+
+    if Keyword.get(opts, :hashcons, false) do
+      translation_unit(state.declarations, share_constructors(program), opts)
+    else
+      translation_unit(state.declarations, program, opts)
     end
   end
+
+  # Convert C expression to iodata
+
+  def cexpr_to_iodata({:literal_expr, value}) when is_number(value),
+    do: to_string(value)
+
+  def cexpr_to_iodata({:literal_expr, value}) when is_boolean(value),
+    do: to_string(value)
+
+  def cexpr_to_iodata({:literal_expr, value}) when is_binary(value),
+    do: [?", value, ?"]
+
+  def cexpr_to_iodata({:symbol_expr, value}) when is_binary(value),
+    do: value
+
+  def cexpr_to_iodata({:address_of_expr, expr}),
+    do: [?&, cexpr_to_iodata(expr)]
+
+  def cexpr_to_iodata({:indirection_expr, expr}),
+    do: [?*, cexpr_to_iodata(expr)]
+
+  def cexpr_to_iodata({:binary_expr, op, expr1, expr2}),
+    do: [?(, cexpr_to_iodata(expr1), ?\s, Atom.to_string(op), ?\s, cexpr_to_iodata(expr2), ?)]
+
+  def cexpr_to_iodata({:postfix_expr, op, expr}),
+    do: [?(, cexpr_to_iodata(expr), Atom.to_string(op), ?)]
+
+  def cexpr_to_iodata({:prefix_expr, op, expr}),
+    do: [?(, Atom.to_string(op), cexpr_to_iodata(expr), ?)]
+
+  def cexpr_to_iodata({:not_expr, expr}),
+    do: [?!, cexpr_to_iodata(expr)]
+
+  def cexpr_to_iodata({:subscript_expr, expr1, expr2}),
+    do: [cexpr_to_iodata(expr1), ?[, cexpr_to_iodata(expr2), ?]]
+
+  def cexpr_to_iodata({:member_access_expr, expr, member}),
+    do: [cexpr_to_iodata(expr), ?., member]
+
+  def cexpr_to_iodata({:cast_expr, typename, expr}) do
+    ["((", specifier(typename), ?\s, declarator_to_iodata(declarator(typename)), ") ", cexpr_to_iodata(expr), ?)]
+  end
+
+  def cexpr_to_iodata({:call_expr, reference, args}) do
+    [cexpr_to_iodata(reference), ?(, Enum.map_intersperse(args, ", ", &Ex2c.cexpr_to_iodata/1), ?)]
+  end
+
+  def cexpr_to_iodata({:compound_literal_expr, type, initializer_list}) do
+    [?(, type, ") ", cinitialization_to_iodata({:initializer_list_initializer, initializer_list})]
+  end
+
+  # Convert C initialization to iodata
+
+  def cinitialization_to_iodata({:expr_initializer, expr}), do: cexpr_to_iodata(expr)
+
+  def cinitialization_to_iodata({:initializer_list_initializer, inits}) do
+    [?{, Enum.map_intersperse(inits, ", ", &Ex2c.cinitialization_to_iodata/1), ?}]
+  end
+
+  def cinitialization_to_iodata({:member_designator_initializer, designators, initializer}) do
+    [Enum.map(designators, fn des -> [?., des] end), " = ", cinitialization_to_iodata(initializer)]
+  end
+
+  # Convert C declaration to iodata
+
+  def declarator_to_iodata({:identifier_declarator, ident})
+      when is_binary(ident),
+      do: ident
+
+  def declarator_to_iodata({:pointer_declarator, decl}),
+    do: ["(*", declarator_to_iodata(decl), ?)]
+
+  def declarator_to_iodata({:array_declarator, decl, expr}),
+    do: [?(, declarator_to_iodata(decl), ?[, cexpr_to_iodata(expr), "])"]
+
+  def declarator_to_iodata({:function_declarator, declarator, params}) do
+    cparams = Enum.map_intersperse(params, ", ", fn {spec, decl} -> [spec, ?\s, declarator_to_iodata(decl)] end)
+    [declarator_to_iodata(declarator), ?(, cparams, ?)]
+  end
+
+  # Convert C initializer to iodata
+
+  def initializer_to_iodata(nil), do: []
+
+  def initializer_to_iodata(init = {:initializer_list_initializer, _inits}), do: [" = ", cinitialization_to_iodata(init)]
+
+  def initializer_to_iodata(init), do: [" = ", cexpr_to_iodata(init)]
+
+  # Convert C statement to iodata
+
+  def stmts_to_iodata(stmts), do: Enum.map(stmts, &Ex2c.stmt_to_iodata/1)
+
+  def stmt_to_iodata({:if_stmt, condition, cons, [{:comment_stmt, _comment}, alt = {:if_stmt, _, _, _}]}),
+    do: stmt_to_iodata({:if_stmt, condition, cons, [alt]})
+
+  def stmt_to_iodata({:if_stmt, condition, cons, [alt = {:if_stmt, _, _, _}]}),
+    do: ["if(", cexpr_to_iodata(condition), ") {\n", stmts_to_iodata(cons), "} else ", stmt_to_iodata(alt)]
+
+  def stmt_to_iodata({:if_stmt, condition, cons, []}),
+    do: ["if(", cexpr_to_iodata(condition), ") {\n", stmts_to_iodata(cons), "}\n"]
+
+  def stmt_to_iodata({:if_stmt, condition, cons, alt}),
+    do: ["if(", cexpr_to_iodata(condition), ") {\n", stmts_to_iodata(cons), "} else {\n", stmts_to_iodata(alt), "}\n"]
+
+  def stmt_to_iodata({:return_stmt, val}),
+    do: ["return ", cexpr_to_iodata(val), ";\n"]
+
+  def stmt_to_iodata({:comment_stmt, comment}),
+    do: ["// ", comment, ?\n]
+
+  def stmt_to_iodata({:expr_stmt, expr}),
+    do: [cexpr_to_iodata(expr), ";\n"]
+
+  def stmt_to_iodata({:for_stmt, init_stmt, cond_expr, expr_expr, body}) do
+    init = String.replace(IO.iodata_to_binary(stmt_to_iodata(init_stmt)), "\n", " ")
+    ["for(", init, cexpr_to_iodata(cond_expr), "; ", cexpr_to_iodata(expr_expr), ") {\n", stmts_to_iodata(body), "}\n"]
+  end
+
+  def stmt_to_iodata({:label_stmt, identifier})
+      when is_binary(identifier),
+      do: [identifier, ":\n"]
+
+  def stmt_to_iodata({:goto_stmt, identifier})
+      when is_binary(identifier),
+      do: ["goto ", identifier, ";\n"]
+
+  def stmt_to_iodata({:declaration_stmt, _spec, []}), do: ";\n"
+
+  def stmt_to_iodata({:declaration_stmt, spec, decls}) do
+    cdecls = Enum.map_intersperse(decls, ", ", fn {decl, init} -> [declarator_to_iodata(decl), initializer_to_iodata(init)] end)
+    [spec, ?\s, cdecls, ";\n"]
+  end
+
+  def stmt_to_iodata({:function_stmt, spec, decl, body}),
+    do: [spec, ?\s, declarator_to_iodata(decl), " {\n", stmts_to_iodata(body), "}\n"]
+
+  # Convert C program to iodata
+
+  def program_to_iodata(program), do: stmts_to_iodata(program)
+
+  def program_to_string(program), do: IO.iodata_to_binary(program_to_iodata(program))
 end
@@ -0,0 +1,303 @@
+defmodule Ex2c.Bench do
+  @moduledoc """
+  End-to-end benchmarks comparing compiled C against the BEAM. Every case is
+  compiled together with a generated `main` by the local C compiler, run, and
+  its output checked against the same function run on the BEAM.
+
+  For the C build, wall time, user space instructions (when the kernel
+  permits `perf_event_open`), allocations and peak RSS are reported. For the
+  BEAM, wall time, reductions, words allocated (approximated from the words
+  reclaimed by garbage collection plus the final heap) and peak RSS are
+  reported. Every BEAM case runs in a fresh peer node so that the collections
+  and RSS of the node are those of the case alone.
+  """
+
+  @include_dir Path.expand("../../include", __DIR__)
+
+  # Stack large enough for the deep body recursion of the larger inputs
+  @stack_size 1_048_576
+
+  def cases do
+    factorial =
+      quote do
+        defmodule Ex2cBench.Factorial do
+          def factorial(0), do: 1
+          def factorial(n), do: n * factorial(n - 1)
+        end
+      end
+
+    gcd =
+      quote do
+        defmodule Ex2cBench.GCD do
+          def gcd(a, 0), do: a
+          def gcd(a, b), do: gcd(b, Kernel.rem(a, b))
+        end
+      end
+
+    bezout =
+      quote do
+        defmodule Ex2cBench.Bezout do
+          def bezout(0, b), do: {b, 0, 1}
+          def bezout(a, b) do
+            {e, f, g} = bezout(Kernel.rem(b, a), a)
+            {e, g - (f * Kernel.div(b, a)), f}
+          end
+        end
+      end
+
+    merge_sort =
+      quote do
+        defmodule Ex2cBench.MergeSort do
+          def slice(a, l, l), do: []
+          def slice([a | as], 0, u), do: [a | slice(as, 0, u - 1)]
+          def slice([a | as], l, u), do: slice(as, l - 1, u - 1)
+          def merge(a, []), do: a
+          def merge([], b), do: b
+          def merge([a | as], bs = [b | _]) when a <= b, do: [a | merge(as, bs)]
+          def merge(as = [a | _], [b | bs]) when a > b, do: [b | merge(as, bs)]
+          def sort([]), do: []
+          def sort([x]), do: [x]
+          def sort(a) do
+            len = Kernel.length(a)
+            half = Kernel.div(len, 2)
+            merge(sort(slice(a, 0, half)), sort(slice(a, half, len)))
+          end
+        end
+      end
+
+    zip =
+      quote do
+        defmodule Ex2cBench.Zip do
+          def zip(a, []), do: []
+          def zip([], b), do: []
+          def zip([a | as], [b | bs]), do: [{a, b} | zip(as, bs)]
+          def unzip([]), do: {[], []}
+          def unzip([{a, b} | abs]) do
+            {as, bs} = unzip(abs)
+            {[a | as], [b | bs]}
+          end
+        end
+      end
+
+    higher_order =
+      quote do
+        defmodule Ex2cBench.MyList do
+          def map([], f), do: []
+          def map([x | xs], f), do: [f.(x) | map(xs, f)]
+          def fold_left([], acc, f), do: acc
+          def fold_left([x | xs], acc, f), do: fold_left(xs, f.(acc, x), f)
+          def fold_right([], acc, f), do: acc
+          def fold_right([x | xs], acc, f), do: f.(x, fold_right(xs, acc, f))
+          def filter([], pred), do: []
+          def filter([x | xs], pred) do
+            xs = filter(xs, pred)
+            if pred.(x) do [x | xs] else xs end
+          end
+          def multiply(x, y), do: map(x, fn x -> y * x end)
+          def sum_left(x), do: fold_left(x, 0, &(&1 + &2))
+          def sum_right(x), do: fold_right(x, 0, fn x, y -> x + y end)
+          def evens(x), do: filter(x, fn x -> Kernel.rem(x, 2) == 0 end)
+        end
+      end
+
+    lists =
+      quote do
+        defmodule Ex2cBench.Lists do
+          def nth(n, l), do: :lists.nth(n, l)
+          def last(l), do: :lists.last(l)
+        end
+      end
+
+    range = Enum.to_list(1..10_000)
+    pairs = Enum.map(1..5_000, fn x -> {x, -x} end)
+
+    [
+      {"factorial", factorial, {Ex2cBench.Factorial, :factorial, [12]}, 100_000},
+      {"gcd", gcd, {Ex2cBench.GCD, :gcd, [832_040, 514_229]}, 100_000},
+      {"bezout", bezout, {Ex2cBench.Bezout, :bezout, [832_040, 514_229]}, 100_000},
+      {"merge_sort", merge_sort, {Ex2cBench.MergeSort, :sort, [Enum.to_list(2_000..1//-1)]}, 20},
+      {"zip", zip, {Ex2cBench.Zip, :zip, [range, Enum.reverse(range)]}, 100},
+      {"unzip", zip, {Ex2cBench.Zip, :unzip, [pairs]}, 100},
+      {"multiply", higher_order, {Ex2cBench.MyList, :multiply, [range, 5]}, 100},
+      {"sum_left", higher_order, {Ex2cBench.MyList, :sum_left, [range]}, 100},
+      {"sum_right", higher_order, {Ex2cBench.MyList, :sum_right, [range]}, 100},
+      {"evens", higher_order, {Ex2cBench.MyList, :evens, [range]}, 100},
+      {"lists_nth", lists, {Ex2cBench.Lists, :nth, [5_000, range]}, 1_000},
+      {"lists_last", lists, {Ex2cBench.Lists, :last, [range]}, 1_000}
+    ]
+  end
+
+  # Render a term the way the runtime's display function does
+
+  def display([]), do: "[]"
+
+  def display(list) when is_list(list), do: "[" <> display_list(list) <> "]"
+
+  def display(int) when is_integer(int), do: Integer.to_string(int)
+
+  def display(atom) when is_atom(atom), do: ":" <> Atom.to_string(atom)
+
+  def display(tuple) when is_tuple(tuple),
+    do: "{" <> Enum.map_join(Tuple.to_list(tuple), ", ", &Ex2c.Bench.display/1) <> "}"
+
+  def display(map) when is_map(map),
+    do: "%{" <> Enum.map_join(Enum.sort(map), ", ", fn {k, v} -> display(k) <> " => " <> display(v) end) <> "}"
+
+  def display(bits) when is_bitstring(bits) do
+    size = bit_size(bits)
+    padded = <<bits::bitstring, 0::size(rem(8 - rem(size, 8), 8))>>
+    tail = if rem(size, 8) == 0, do: "", else: " :: #{rem(size, 8)}"
+    "<<" <> Enum.map_join(:binary.bin_to_list(padded), ", ", &Integer.to_string/1) <> tail <> ">>"
+  end
+
+  def display_list([x]), do: display(x)
+
+  def display_list([x | xs]) when is_list(xs), do: display(x) <> ", " <> display_list(xs)
+
+  def display_list([x | tail]), do: display(x) <> " | " <> display(tail)
+
+  # Build the C statements constructing an argument. Lists are built one cell
+  # at a time to keep the generated expressions shallow.
+
+  def compile_argument(name, list) when is_list(list) and list != [] do
+    symbol = {:symbol_expr, name}
+    cells =
+      for x <- Enum.reverse(list) do
+        {:expr_stmt, {:binary_expr, :=, symbol, {:call_expr, {:symbol_expr, "make_list"}, [Ex2c.compile_literal(x), symbol]}}}
+      end
+    [{:declaration_stmt, "struct term", [{{:identifier_declarator, name}, Ex2c.compile_literal([])}]} | cells]
+  end
+
+  def compile_argument(name, term) do
+    [{:declaration_stmt, "struct term", [{{:identifier_declarator, name}, Ex2c.compile_literal(term)}]}]
+  end
+
+  def compile_main({module, function, args}, iterations) do
+    names = for i <- 0..(length(args) - 1)//1, do: "arg#{i}"
+    arguments = Enum.zip(names, args) |> Enum.flat_map(fn {name, arg} -> compile_argument(name, arg) end)
+    counter = {:symbol_expr, "i"}
+    ccall = {:call_expr, {:symbol_expr, "call_#{length(args)}"},
+      [{:symbol_expr, Ex2c.compile_label({module, function, length(args)})} | Enum.map(names, &{:symbol_expr, &1})]}
+    body =
+      arguments ++ [
+        {:declaration_stmt, "struct term", [{{:identifier_declarator, "result"}, nil}]},
+        {:expr_stmt, {:call_expr, {:symbol_expr, "bench_start"}, []}},
+        {:for_stmt, {:declaration_stmt, "int", [{{:identifier_declarator, "i"}, {:literal_expr, 0}}]},
+         {:binary_expr, :<, counter, {:literal_expr, iterations}}, {:postfix_expr, :++, counter},
+         [{:expr_stmt, {:binary_expr, :=, {:symbol_expr, "result"}, ccall}}]},
+        {:expr_stmt, {:call_expr, {:symbol_expr, "bench_stop"}, []}},
+        {:expr_stmt, {:call_expr, {:symbol_expr, "display"}, [{:symbol_expr, "result"}]}},
+        {:expr_stmt, {:call_expr, {:symbol_expr, "bench_report"}, []}},
+        {:return_stmt, {:literal_expr, 0}}
+      ]
+    {:function_stmt, "int", {:function_declarator, {:identifier_declarator, "main"}, []}, body}
+  end
+
+  @doc """
+  Compile a case, whose modules have already been compiled into
+  `{module, beam}` pairs, into an executable in `output_dir` and return its
+  path.
+  """
+  def build({name, modules, mfa = {module, function, args}, iterations}, output_dir, opts \\ []) do
+    beams = Enum.map(modules, fn {_module, beam} -> beam end)
+    {:lists, lists, _filename} = :code.get_object_code(:lists)
+    program = Ex2c.compile_program(beams ++ [lists], [{module, function, length(args)}], comments: false)
+    source = Path.join(output_dir, name <> ".c")
+    executable = Path.join(output_dir, name)
+    cc = Keyword.get(opts, :cc, System.get_env("CC", "cc"))
+    cflags = Keyword.get(opts, :cflags, ["-O2"])
+
+    File.mkdir_p!(output_dir)
+    main = Ex2c.program_to_iodata([compile_main(mfa, iterations)])
+    File.write!(source, [program, "#include \"ex2c_bench.h\"\n", main])
+
+    args =
+      cflags ++ ["-std=gnu2x", "-DEX2C_STACK_SIZE=#{@stack_size}", "-DEX2C_NO_GUEST_ENV=\"when benchmarking\"", "-I", @include_dir, source, "-o", executable,
+                 "-Wl,--wrap=malloc", "-Wl,--wrap=calloc", "-Wl,--wrap=realloc"]
+
+    case System.cmd(cc, args, stderr_to_stdout: true) do
+      {_output, 0} -> executable
+      {output, status} -> raise "#{cc} exited with status #{status}:\n#{output}"
+    end
+  end
+
+  def run_c(executable) do
+    {output, 0} = System.cmd(executable, [])
+    [report, result | _] = output |> String.split("\n", trim: true) |> Enum.reverse()
+    {result, JSON.decode!(report)}
+  end
+
+  @doc """
+  Run a case on the BEAM in a fresh peer node into which its modules are
+  loaded, and return its result and measurements.
+  """
+  def run_beam(modules, mfa, iterations) do
+    code_path = Enum.flat_map(:code.get_path(), &[~c"-pa", &1])
+    {:ok, peer} = :peer.start_link(%{connection: :standard_io, args: code_path})
+
+    try do
+      {:ok, _apps} = :peer.call(peer, :application, :ensure_all_started, [:elixir])
+      for {module, beam} <- modules do
+        {:module, ^module} = :peer.call(peer, :code, :load_binary, [module, ~c"nofile", beam])
+      end
+      {result, measurements} = :peer.call(peer, __MODULE__, :measure_beam, [mfa, iterations], :infinity)
+      {display(result), measurements}
+    after
+      :peer.stop(peer)
+    end
+  end
+
+  @doc false
+  def measure_beam({module, function, args}, iterations) do
+    task =
+      Task.async(fn ->
+        :erlang.garbage_collect()
+        {:reductions, reductions} = :erlang.process_info(self(), :reductions)
+        {_gcs, reclaimed, _} = :erlang.statistics(:garbage_collection)
+        start = System.monotonic_time(:nanosecond)
+        result = Enum.reduce(1..iterations, nil, fn _, _ -> apply(module, function, args) end)
+        stop = System.monotonic_time(:nanosecond)
+        {_gcs, reclaimed2, _} = :erlang.statistics(:garbage_collection)
+        {:reductions, reductions2} = :erlang.process_info(self(), :reductions)
+        {:total_heap_size, heap} = :erlang.process_info(self(), :total_heap_size)
+        {result, %{
+          "wall_ns" => stop - start,
+          "reductions" => reductions2 - reductions,
+          "allocated_words" => reclaimed2 - reclaimed + heap,
+          "peak_rss_kb" => peak_rss_kb()
+        }}
+      end)
+    Task.await(task, :infinity)
+  end
+
+  defp peak_rss_kb do
+    with {:ok, status} <- File.read("/proc/self/status"),
+         [_, kb] <- Regex.run(~r/VmHWM:\s+(\d+) kB/, status) do
+      String.to_integer(kb)
+    else
+      _ -> nil
+    end
+  end
+
+  @doc """
+  Run every case whose name is in `only`, or all of them when `only` is
+  empty, and return the results as maps ready to be encoded into JSON.
+  """
+  def run(output_dir, opts \\ []) do
+    only = Keyword.get(opts, :only, [])
+
+    for {name, quoted, mfa, default_iterations} <- cases(), only == [] or name in only do
+      iterations = Keyword.get(opts, :iterations, default_iterations)
+      modules = Code.compile_quoted(quoted)
+      {c_result, c} = run_c(build({name, modules, mfa, iterations}, output_dir, opts))
+      {beam_result, beam} = run_beam(modules, mfa, iterations)
+      %{
+        "name" => name,
+        "iterations" => iterations,
+        "correct" => c_result == beam_result,
+        "c" => c,
+        "beam" => beam
+      }
+    end
+  end
+end
@@ -0,0 +1,139 @@
+defmodule Ex2c.Nif do
+  @moduledoc """
+  Wraps compiled modules into NIF libraries so that their functions can be
+  called natively from a running node.
+
+  Every exported function `f/n` of a module `M` is exposed by the module
+  `M.Native` both as `f/n`, which runs on a normal scheduler, and as
+  `f_dirty/n`, which runs on a dirty CPU scheduler and suits long calls.
+  Arguments and results are converted directly between BEAM terms and
+  runtime terms, and every scheduler thread has its own virtual machine
+  state. Runtime errors are raised as exceptions in the calling process, and
+  the terms allocated by a call are released once its result is converted.
+  """
+
+  @include_dir Path.expand("../../include", __DIR__)
+
+  # Terms on the stack of every scheduler thread, bounding the depth of body
+  # recursion before calls raise system_limit. Compiled functions recurse on
+  # the C stack of the scheduler too, which is only 128 kilowords by default.
+  @stack_size 8192
+
+  # Functions generated by the Elixir and Erlang compilers that only make
+  # sense inside the BEAM
+
+  @reserved [:module_info, :__info__]
+
+  def native_module(module), do: Module.concat(module, Native)
+
+  def exports(beam) do
+    {:beam_file, _module, labeled_exports, _attributes, _compile_info, _code} = :beam_disasm.file(beam)
+    for {name, arity, _label} <- labeled_exports, name not in @reserved, do: {name, arity}
+  end
+
+  def dirty_name(name), do: :"#{name}_dirty"
+
+  # Build the NIF that forwards to a compiled function
+
+  def compile_nif({module, name, arity}) do
+    nif_decl =
+      {:function_declarator,
+       {:identifier_declarator, "nif_" <> Ex2c.compile_label({module, name, arity})},
+       [{"ErlNifEnv", {:pointer_declarator, {:identifier_declarator, "env"}}},
+        {"int", {:identifier_declarator, "argc"}},
+        {"const ERL_NIF_TERM", {:pointer_declarator, {:identifier_declarator, "argv"}}}]}
+    ccall = {:call_expr, {:symbol_expr, "nif_call"}, [
+      {:symbol_expr, "env"},
+      {:symbol_expr, "argc"},
+      {:symbol_expr, "argv"},
+      {:symbol_expr, Ex2c.compile_label({module, name, arity})}]}
+    {:function_stmt, "static ERL_NIF_TERM", nif_decl, [{:return_stmt, ccall}]}
+  end
+
+  def nif_func_entry({module, name, arity}, nif_name, flags) do
+    ["  {\"", Atom.to_string(nif_name), "\", ", Integer.to_string(arity), ", nif_",
+     Ex2c.compile_label({module, name, arity}), ", ", flags, "},\n"]
+  end
+
+  @doc """
+  Generate the C source of a NIF library wrapping the given BEAM bytes.
+  Accepts the same options as `Ex2c.compile_bytes/2`.
+  """
+  def shim(beam, opts \\ []) do
+    {module, declarations, program, _dependencies} = Ex2c.compile_module(beam, opts)
+    mfas = for {name, arity} <- exports(beam), do: {module, name, arity}
+
+    funcs =
+      for mfa = {_module, name, _arity} <- mfas do
+        [nif_func_entry(mfa, name, "0"), nif_func_entry(mfa, dirty_name(name), "ERL_NIF_DIRTY_JOB_CPU_BOUND")]
+      end
+
+    IO.iodata_to_binary([
+      Ex2c.prelude(opts),
+      "#include \"ex2c_nif.h\"\n",
+      Ex2c.program_to_iodata(declarations ++ program ++ Enum.map(mfas, &Ex2c.Nif.compile_nif/1)),
+      "static ErlNifFunc nif_funcs[] = {\n", funcs, "};\n",
+      "ERL_NIF_INIT(", Atom.to_string(native_module(module)), ", nif_funcs, NULL, NULL, NULL, NULL)\n"
+    ])
+  end
+
+  @doc """
+  Build the NIF library for the given BEAM bytes into `output_dir`, returning
+  the path of the shared object without its extension as expected by
+  `:erlang.load_nif/2`. The following options are supported in addition to
+  those of `shim/2`:
+
+    * `:cc` - the C compiler. Defaults to the `CC` environment variable or `cc`.
+
+    * `:cflags` - extra flags for the C compiler. Defaults to `["-O2"]`.
+
+    * `:stack_size` - the number of terms on the stack of each scheduler
+      thread. Calls recursing deeper raise `system_limit`. Defaults to 8192.
+      Larger stacks may also need larger scheduler stacks, see `+sss`.
+  """
+  def build(beam, output_dir, opts \\ []) do
+    {:beam_file, module, _labeled_exports, _attributes, _compile_info, _code} = :beam_disasm.file(beam)
+    name = Ex2c.escape_identifier(Atom.to_string(native_module(module)))
+    source = Path.join(output_dir, name <> ".c")
+    library = Path.join(output_dir, name)
+    erts_include = Path.join([:code.root_dir(), "erts-#{:erlang.system_info(:version)}", "include"])
+    cc = Keyword.get(opts, :cc, System.get_env("CC", "cc"))
+    cflags = Keyword.get(opts, :cflags, ["-O2"])
+    stack_size = Keyword.get(opts, :stack_size, @stack_size)
+
+    File.mkdir_p!(output_dir)
+    File.write!(source, shim(beam, opts))
+
+    args = cflags ++ ["-std=gnu2x", "-fPIC", "-shared", "-DEX2C_STACK_SIZE=#{stack_size}", "-I", erts_include, "-I", @include_dir, source, "-o", library <> ".so"]
+
+    case System.cmd(cc, args, stderr_to_stdout: true) do
+      {_output, 0} -> library
+      {output, status} -> raise "#{cc} exited with status #{status}:\n#{output}"
+    end
+  end
+
+  @doc """
+  Define the native counterpart of `module` and load the NIF library at
+  `library` into it. Calling `M.Native.f(...)` then runs the compiled `M.f`.
+  """
+  def load(module, library) do
+    {^module, beam, _filename} = :code.get_object_code(module)
+
+    stubs =
+      for {name, arity} <- exports(beam), fun_name <- [name, dirty_name(name)] do
+        args = Macro.generate_arguments(arity, __MODULE__)
+        quote do
+          def unquote(fun_name)(unquote_splicing(args)), do: :erlang.nif_error(:nif_not_loaded)
+        end
+      end
+
+    loader =
+      quote do
+        def __load_nif__(path), do: :erlang.load_nif(path, 0)
+      end
+
+    contents = {:__block__, [], [loader | stubs]}
+    {:module, native, _binary, _result} = Module.create(native_module(module), contents, Macro.Env.location(__ENV__))
+    native.__load_nif__(String.to_charlist(library))
+  end
+end
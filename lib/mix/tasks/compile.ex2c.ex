@@ -0,0 +1,220 @@
+defmodule Mix.Tasks.Compile.Ex2c do
+  use Mix.Task.Compiler
+
+  @shortdoc "Compiles the project's BEAM modules into C"
+
+  @moduledoc """
+  Compiles BEAM modules into C using `Ex2c`. Enable it by appending `:ex2c`
+  to the project's compilers so that it runs after the Elixir compiler:
+
+      compilers: Mix.compilers() ++ [:ex2c]
+
+  It is configured through the `:ex2c` key of the project configuration:
+
+    * `:modules` - the modules to compile. Defaults to every module in the
+      project's compile path.
+
+    * `:output` - the directory receiving the generated C. Defaults to
+      `"c_src/ex2c"`.
+
+    * `:hashcons`, `:comments`, `:instrument` and `:etf` - passed on to
+      `Ex2c.compile_bytes/2`.
+
+    * `:profile` - the path of a profile written by `profile_dump` from an
+      instrumented build, used to optimize the generated C. Modules are
+      recompiled when its contents change.
+
+  Every module `M` produces a header `M.h` holding its forward declarations
+  and a source `M.c` holding its function definitions, which includes the
+  headers of the modules it calls. Headers are only rewritten when their
+  contents change, so dependent modules are left untouched. The file `ex2c.c`
+  includes the runtime followed by every module source and is the
+  translation unit to hand to the C compiler.
+
+  A module is only recompiled when the hash of its BEAM code, or the version
+  of the compiler, differs from the one recorded in the manifest. Stale
+  modules are compiled in parallel.
+
+  ## Command line options
+
+    * `--force` - recompiles every module regardless of the manifest
+  """
+
+  @recursive true
+  @manifest "compile.ex2c"
+  @manifest_vsn 1
+
+  # Chunks that the disassembled code of a module depends on
+  @chunks [~c"Code", ~c"AtU8", ~c"Atom", ~c"ImpT", ~c"ExpT", ~c"LitT", ~c"FunT"]
+
+  @impl true
+  def run(args) do
+    {opts, _, _} = OptionParser.parse(args, switches: [force: :boolean])
+    config = Keyword.get(Mix.Project.config(), :ex2c, [])
+    output = Keyword.get(config, :output, "c_src/ex2c")
+    compile_opts = Keyword.take(config, [:hashcons, :comments, :instrument, :etf])
+    compile_opts = if path = config[:profile], do: Keyword.put(compile_opts, :profile, Ex2c.read_profile(path)), else: compile_opts
+    version = compiler_version()
+
+    disk_manifest = read_manifest()
+    old_manifest = if opts[:force], do: %{}, else: disk_manifest
+    modules = Enum.map(beams(config), fn beam -> {module_name(beam), beam} end)
+    names = MapSet.new(modules, fn {module, _beam} -> module end)
+    manifest = Map.new(modules, fn {module, beam} -> {module, cache_key(beam, names, version, compile_opts)} end)
+
+    stale =
+      Enum.reject(modules, fn {module, _beam} ->
+        old_manifest[module] == manifest[module] and File.exists?(header_path(output, module)) and
+          File.exists?(source_path(output, module))
+      end)
+
+    # Forcing a recompilation must still clean up after deleted modules
+    removed = Enum.reject(Map.keys(disk_manifest), &MapSet.member?(names, &1))
+
+    File.mkdir_p!(output)
+
+    stale
+    |> Task.async_stream(fn {_module, beam} -> write_module(output, beam, names, compile_opts) end, timeout: :infinity)
+    |> Stream.run()
+
+    for module <- removed do
+      File.rm(header_path(output, module))
+      File.rm(source_path(output, module))
+    end
+
+    write_if_changed(Path.join(output, "ex2c.c"), unity_source(Enum.sort(names), compile_opts))
+    write_manifest(manifest)
+
+    if stale == [] and removed == [], do: {:noop, []}, else: {:ok, []}
+  end
+
+  @impl true
+  def manifests, do: [manifest_path()]
+
+  @impl true
+  def clean do
+    config = Keyword.get(Mix.Project.config(), :ex2c, [])
+    output = Keyword.get(config, :output, "c_src/ex2c")
+
+    for module <- Map.keys(read_manifest()) do
+      File.rm(header_path(output, module))
+      File.rm(source_path(output, module))
+    end
+
+    File.rm(Path.join(output, "ex2c.c"))
+    File.rm(manifest_path())
+  end
+
+  # Locate the BEAM code of the configured modules
+
+  defp beams(config) do
+    case Keyword.fetch(config, :modules) do
+      {:ok, modules} ->
+        Enum.map(modules, fn module ->
+          {^module, beam, _filename} = :code.get_object_code(module)
+          beam
+        end)
+
+      :error ->
+        Mix.Project.compile_path()
+        |> Path.join("*.beam")
+        |> Path.wildcard()
+        |> Enum.map(&File.read!/1)
+    end
+  end
+
+  defp module_name(beam) do
+    {:ok, {module, _chunks}} = :beam_lib.chunks(beam, [~c"Code"])
+    module
+  end
+
+  # Key the generated C on the BEAM code, the compiler and its options
+
+  defp compiler_version do
+    {Application.spec(:ex2c, :vsn), Ex2c.module_info(:md5)}
+  end
+
+  defp cache_key(beam, names, version, compile_opts) do
+    {:ok, {_module, chunks}} = :beam_lib.chunks(beam, @chunks, [:allow_missing_chunks])
+    # The includes of a module depend on which of the modules that it calls or
+    # captures funs of are compiled too. Both are read from the chunks rather
+    # than the disassembled code so that unchanged builds stay cheap.
+    {:ok, {_module, [imports: imports]}} = :beam_lib.chunks(beam, [:imports])
+    called = for {module, _function, _arity} <- imports, do: module
+    captured = Ex2c.external_modules(literals(chunks))
+    linked = for module <- called ++ captured, MapSet.member?(names, module), uniq: true, do: module
+    :erlang.md5(:erlang.term_to_binary({chunks, linked, version, compile_opts}))
+  end
+
+  # Decode the literal table, which is compressed unless its size is zero
+
+  defp literals(chunks) do
+    case List.keyfind(chunks, ~c"LitT", 0) do
+      {_id, <<0::32, table::binary>>} -> decode_literals(table)
+      {_id, <<_size::32, compressed::binary>>} -> decode_literals(:zlib.uncompress(compressed))
+      _ -> []
+    end
+  end
+
+  defp decode_literals(<<_count::32, entries::binary>>) do
+    for <<size::32, literal::binary-size(size) <- entries>>, do: :erlang.binary_to_term(literal)
+  end
+
+  # Generated file layout
+
+  defp file_name(module), do: Ex2c.escape_identifier(Atom.to_string(module))
+
+  defp header_path(output, module), do: Path.join(output, file_name(module) <> ".h")
+
+  defp source_path(output, module), do: Path.join(output, file_name(module) <> ".c")
+
+  defp write_module(output, beam, names, compile_opts) do
+    {module, declarations, program, dependencies} = Ex2c.compile_module(beam, compile_opts)
+    guard = String.upcase(file_name(module)) <> "_H"
+
+    header = [
+      "#ifndef ", guard, "\n#define ", guard, "\n",
+      Ex2c.program_to_iodata(declarations),
+      "#endif\n"
+    ]
+
+    includes =
+      for dependency <- [module | dependencies], MapSet.member?(names, dependency),
+        do: ["#include \"", file_name(dependency), ".h\"\n"]
+
+    write_if_changed(header_path(output, module), header)
+    write_if_changed(source_path(output, module), [includes, Ex2c.program_to_iodata(program)])
+  end
+
+  defp unity_source(modules, compile_opts) do
+    [Ex2c.prelude(compile_opts), "#include \"ex2crt.h\"\n", Enum.map(modules, fn module -> ["#include \"", file_name(module), ".c\"\n"] end)]
+  end
+
+  # Leave unchanged files alone so that their timestamps stay stable
+
+  defp write_if_changed(path, contents) do
+    contents = IO.iodata_to_binary(contents)
+
+    if File.read(path) != {:ok, contents} do
+      File.write!(path, contents)
+    end
+  end
+
+  # Manifest mapping each compiled module to its cache key
+
+  defp manifest_path, do: Path.join(Mix.Project.manifest_path(), @manifest)
+
+  defp read_manifest do
+    with {:ok, contents} <- File.read(manifest_path()),
+         {@manifest_vsn, manifest} <- :erlang.binary_to_term(contents) do
+      manifest
+    else
+      _ -> %{}
+    end
+  end
+
+  defp write_manifest(manifest) do
+    File.mkdir_p!(Path.dirname(manifest_path()))
+    File.write!(manifest_path(), :erlang.term_to_binary({@manifest_vsn, manifest}))
+  end
+end
@@ -0,0 +1,79 @@
+defmodule Mix.Tasks.Ex2c.Bench do
+  use Mix.Task
+
+  @shortdoc "Benchmarks compiled C against the BEAM"
+
+  @moduledoc """
+  Builds the benchmark cases of `Ex2c.Bench` with the local C compiler, runs
+  them next to the same functions on the BEAM, checks that both produce the
+  same result, and prints a comparison:
+
+      mix ex2c.bench [NAME ...]
+
+  Only the named cases are run when names are given. The results are also
+  written as JSON, together with the current git commit, so that they can be
+  compared between commits.
+
+  ## Command line options
+
+    * `--output` - the JSON file receiving the results. Defaults to
+      `ex2c_bench.json` in the build directory.
+
+    * `--build-dir` - the directory receiving the generated C and
+      executables. Defaults to `ex2c_bench` in the build directory.
+
+    * `--iterations` - overrides the number of calls made by every case
+
+    * `--cc` - the C compiler. Defaults to the `CC` environment variable or
+      `cc`.
+  """
+
+  @requirements ["compile"]
+
+  @impl true
+  def run(args) do
+    {opts, only, _} = OptionParser.parse(args, strict: [output: :string, build_dir: :string, iterations: :integer, cc: :string])
+    output = Keyword.get(opts, :output, Path.join(Mix.Project.build_path(), "ex2c_bench.json"))
+    build_dir = Keyword.get(opts, :build_dir, Path.join(Mix.Project.build_path(), "ex2c_bench"))
+
+    results = Ex2c.Bench.run(build_dir, [only: only] ++ Keyword.take(opts, [:iterations, :cc]))
+
+    Mix.shell().info(format_row(["case", "ok", "c ms", "beam ms", "speedup", "c instrs", "c allocs", "beam words", "c rss kB", "beam rss kB"]))
+
+    for %{"name" => name, "correct" => correct, "c" => c, "beam" => beam} <- results do
+      Mix.shell().info(format_row([
+        name,
+        if(correct, do: "yes", else: "NO"),
+        milliseconds(c["wall_ns"]),
+        milliseconds(beam["wall_ns"]),
+        :erlang.float_to_binary(beam["wall_ns"] / max(c["wall_ns"], 1), decimals: 2),
+        c["instructions"],
+        c["allocations"],
+        beam["allocated_words"],
+        c["peak_rss_kb"],
+        beam["peak_rss_kb"]
+      ]))
+    end
+
+    File.mkdir_p!(Path.dirname(output))
+    File.write!(output, JSON.encode!(%{"commit" => commit(), "results" => results}))
+    Mix.shell().info("Wrote #{output}")
+
+    if Enum.any?(results, &(not &1["correct"])) do
+      Mix.raise("Compiled C and the BEAM disagree on some results")
+    end
+  end
+
+  defp milliseconds(ns), do: :erlang.float_to_binary(ns / 1_000_000, decimals: 3)
+
+  defp format_row(cells), do: Enum.map_join(cells, " ", fn cell -> String.pad_leading(to_string(cell), 12) end)
+
+  defp commit do
+    case System.cmd("git", ["rev-parse", "HEAD"], stderr_to_stdout: true) do
+      {sha, 0} -> String.trim(sha)
+      _ -> nil
+    end
+  rescue
+    ErlangError -> nil
+  end
+end
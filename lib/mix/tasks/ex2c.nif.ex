@@ -0,0 +1,43 @@
+defmodule Mix.Tasks.Ex2c.Nif do
+  use Mix.Task
+
+  @shortdoc "Builds NIF libraries from compiled modules"
+
+  @moduledoc """
+  Compiles the given modules into C and builds each into a NIF library that
+  `Ex2c.Nif.load/2` can load into a running node:
+
+      mix ex2c.nif MyApp.Hot :lists --output priv/ex2c
+
+  Erlang modules are given with a leading colon.
+
+  ## Command line options
+
+    * `--output` - the directory receiving the libraries. Defaults to
+      `priv/ex2c`.
+
+    * `--cc` - the C compiler. Defaults to the `CC` environment variable or
+      `cc`.
+
+    * `--hashcons` and `--no-comments` - see `Ex2c.compile_bytes/2`
+  """
+
+  @requirements ["compile"]
+
+  @impl true
+  def run(args) do
+    {opts, names, _} = OptionParser.parse(args, strict: [output: :string, cc: :string, hashcons: :boolean, comments: :boolean])
+    output = Keyword.get(opts, :output, "priv/ex2c")
+
+    for name <- names do
+      module = parse_module(name)
+      {^module, beam, _filename} = :code.get_object_code(module)
+      library = Ex2c.Nif.build(beam, output, Keyword.take(opts, [:cc, :hashcons, :comments]))
+      Mix.shell().info("Generated #{library}.so")
+    end
+  end
+
+  defp parse_module(":" <> name), do: String.to_atom(name)
+
+  defp parse_module(name), do: Module.concat([name])
+end
@@ -51,6 +51,228 @@ defmodule Ex2cTest do
     Logger.info(output)
   end
 
+  test "compile the gcd function without instruction comments" do
+    quoted =
+      quote do
+        defmodule GCDNoComments do
+          def gcd(a, 0), do: a
+          def gcd(a, b), do: gcd(b, Kernel.rem(a, b))
+        end
+      end
+    output = Ex2c.compile_bytes(Code.compile_quoted(quoted)[GCDNoComments], comments: false)
+    refute String.contains?(output, "//")
+    Logger.info(output)
+  end
+
+  test "compile functions concurrently into deterministic output" do
+    {:lists, beam, _filename} = :code.get_object_code(:lists)
+    compile = fn opts ->
+      {_module, declarations, program, _dependencies} = Ex2c.compile_module(beam, opts)
+      IO.iodata_to_binary(Ex2c.program_to_iodata(declarations ++ program))
+    end
+    output = compile.([])
+    assert compile.([]) == output
+    assert compile.(max_concurrency: 1) == output
+    assert compile.(max_concurrency: 3) == output
+    program = Ex2c.compile_program([beam], [{:lists, :reverse, 1}])
+    assert Ex2c.compile_program([beam], [{:lists, :reverse, 1}], max_concurrency: 1) == program
+  end
+
+  @doc """
+  int main() {
+  display(call_2(Elixir2EProfiledReverser_reverse_2, make_list(make_small(1), make_list(make_small(2), make_nil())), make_nil()));
+  // Expected output: [2, 1]
+  profile_dump("/dev/stdout");
+  // Expected output: a flat profile charging the new list cells to put_list
+  return 0;
+  }
+  """
+  test "compile an instrumented function" do
+    quoted =
+      quote do
+        defmodule ProfiledReverser do
+          def reverse([], acc), do: acc
+          def reverse([x | xs], acc), do: reverse(xs, [x | acc])
+          def seed(), do: reverse([1, 2], [])
+        end
+      end
+    output = Ex2c.compile_bytes(Code.compile_quoted(quoted)[ProfiledReverser], instrument: true)
+    assert String.contains?(output, "#define EX2C_PROFILE")
+    assert String.contains?(output, "profile_enter(&profile_Elixir2EProfiledReverser_reverse_2_info)")
+    # Constructing the literal list is charged to its own site
+    assert output =~ ~r/"Elixir2EProfiledReverser_seed_0", "move@\d+"/
+    Logger.info(output)
+  end
+
+  test "compile a dispatcher using a recorded profile" do
+    quoted =
+      quote do
+        defmodule Dispatcher do
+          def dispatch(:rare), do: 1
+          def dispatch(:usual), do: 2
+          def unused(x), do: x
+        end
+      end
+    beam = Code.compile_quoted(quoted)[Dispatcher]
+    # Name the edges of the select_val after its targets, as an instrumented build would
+    {:beam_file, Dispatcher, _labeled_exports, _attributes, _compile_info, code} = :beam_disasm.file(beam)
+    [arms] = for {:function, :dispatch, 1, _entry, body} <- code, {:select_val, _selector, _fail, {:list, arms}} <- body, do: arms
+    targets = for [{:atom, value}, label] <- Enum.chunk_every(arms, 2), into: %{}, do: {value, Ex2c.compile_label(label)}
+    instrumented = Ex2c.compile_bytes(beam, instrument: true)
+    [site] = Regex.run(~r/"(select_val@\d+):#{targets[:usual]}"/, instrumented, capture: :all_but_first)
+    profile = %{"Elixir2EDispatcher_dispatch_1" => %{"entry" => 100, site => 100,
+                "#{site}:#{targets[:usual]}" => 99, "#{site}:#{targets[:rare]}" => 1}}
+    output = Ex2c.compile_bytes(beam, profile: profile, comments: false)
+    assert String.contains?(output, "__attribute__((hot)) struct term Elixir2EDispatcher_dispatch_1()")
+    assert String.contains?(output, "__attribute__((cold, noinline)) struct term Elixir2EDispatcher_unused_1()")
+    # The common value is tested first and hinted as likely, although it sorts after the rare one
+    assert String.contains?(output, ~s/__builtin_expect((cmp_exact(xs[0], make_atom(5, "usual")) == 0), 1)/)
+    {usual, _length} = :binary.match(output, ~s/"usual"/)
+    {rare, _length} = :binary.match(output, ~s/"rare"/)
+    assert usual < rare
+    Logger.info(output)
+  end
+
+  @doc """
+  int main() {
+  display(call_2(Elixir2EAdder_add_all_2, make_list(make_small(1), make_list(make_small(2), make_nil())), make_small(10)));
+  // Expected output: [11, 12]
+  display(call_1(Elixir2EAdder_twice_1, make_small(5)));
+  // Expected output: 7
+  display(call_2(Elixir2EAdder_scale_twice_2, make_small(3), make_small(2)));
+  // Expected output: 12
+  return 0;
+  }
+  """
+  test "compile calls through known funs" do
+    quoted =
+      quote do
+        defmodule Adder do
+          def add_all(xs, n), do: map(xs, fn x -> x + n end)
+          def map([], _f), do: []
+          def map([x | xs], f), do: [f.(x) | map(xs, f)]
+          def inc(x), do: x + 1
+          def twice(x) do
+            f = &Adder.inc/1
+            f.(f.(x))
+          end
+          def scale_twice(x, n) do
+            f = fn y -> y * n end
+            f.(f.(x))
+          end
+        end
+      end
+    output = Ex2c.compile_bytes(Code.compile_quoted(quoted)[Adder])
+    # The captured function is called directly rather than through the fun
+    assert String.contains?(output, "xs[0] = Elixir2EAdder_inc_1())")
+    # The closure passed to map escapes, while the one only called locally does not
+    assert String.contains?(output, "make_fun(")
+    assert String.contains?(output, "make_fun_scoped(")
+    Logger.info(output)
+  end
+
+  @doc """
+  int main() {
+  display(call_1(Elixir2EDivMod_digit_sum_1, make_small(1234)));
+  // Expected output: 10
+  display(call_2(Elixir2EDivMod_divmod_2, make_small(17), make_small(5)));
+  // Expected output: {3, 2}
+  return 0;
+  }
+  """
+  test "compile a function returning an unboxed tuple" do
+    quoted =
+      quote do
+        defmodule DivMod do
+          def divmod(a, b), do: {Kernel.div(a, b), Kernel.rem(a, b)}
+          def digit_sum(0), do: 0
+          def digit_sum(n) do
+            {q, r} = divmod(n, 10)
+            r + digit_sum(q)
+          end
+        end
+      end
+    beam = Code.compile_quoted(quoted)[DivMod]
+    output = Ex2c.compile_bytes(beam)
+    assert String.contains?(output, "static struct term Elixir2EDivMod_divmod_2_unboxed()")
+    # The recursive caller reads the elements directly, without testing or building the tuple
+    [_, rest] = String.split(Ex2c.compile_bytes(beam, comments: false), "struct term Elixir2EDivMod_digit_sum_1() {", parts: 2)
+    [digit_sum | _] = String.split(rest, ~r/\n[^\n]*struct term \w+\(\) \{/, parts: 2)
+    assert String.contains?(digit_sum, "Elixir2EDivMod_divmod_2_unboxed();")
+    refute String.contains?(digit_sum, "is_tuple(")
+    refute String.contains?(digit_sum, "make_tuple(")
+    Logger.info(output)
+  end
+
+  test "keep tuples and lists that do not escape their block local" do
+    code = [
+      {:label, 1},
+      {:put_tuple2, {:x, 1}, {:list, [{:x, 0}, {:atom, :ok}]}},
+      {:get_tuple_element, {:x, 1}, 0, {:x, 2}},
+      {:put_list, {:x, 2}, nil, {:x, 3}},
+      {:get_hd, {:x, 3}, {:x, 0}},
+      # Stored into another term, and returned
+      {:put_list, {:x, 0}, nil, {:x, 1}},
+      {:put_tuple2, {:x, 0}, {:list, [{:x, 1}, {:x, 2}]}},
+      :return
+    ]
+    code = Ex2c.devirtualize(Local, code, %{})
+    assert [{:label, 1}, {:put_tuple2_scoped, {:x, 1}, _}, _, {:put_list_scoped, {:x, 2}, nil, {:x, 3}}, _,
+            {:put_list, {:x, 0}, nil, {:x, 1}}, {:put_tuple2, {:x, 0}, _}, :return] = code
+    output =
+      code
+      |> Enum.flat_map(fn instr -> elem(Ex2c.compile_code(instr, %Ex2c{comments: false}), 0) end)
+      |> Ex2c.stmts_to_iodata()
+      |> IO.iodata_to_binary()
+    assert String.contains?(output, "xs[1] = make_tuple_scoped(2, ")
+    assert String.contains?(output, "put_list_scoped(")
+    assert String.contains?(output, "put_list(xs[0], make_nil(), &xs[1])")
+    assert String.contains?(output, "xs[0] = make_tuple(2, ")
+  end
+
+  @doc """
+  Terms are encoded in and decoded from the External Term Format natively, which can be used as follows:
+  int main(int argc, char *argv[]) {
+  display(call_1(Elixir2EExternal_encode_1, make_list(make_small(104), make_list(make_atom(2, "ok"), make_nil()))));
+  // Expected output: <<131, 108, 0, 0, 0, 2, 97, 104, 119, 2, 111, 107, 106>>
+  display(call_1(Elixir2EExternal_round_trip_1, make_list(make_small(104), make_list(make_small(105), make_nil()))));
+  // Expected output: [104, 105]
+  return 0;
+  }
+  """
+  test "compile calls to the External Term Format codec" do
+    quoted =
+      quote do
+        defmodule External do
+          def encode(x), do: :erlang.term_to_binary(x)
+          def decode(x), do: :erlang.binary_to_term(x)
+          def round_trip(x), do: :erlang.binary_to_term(:erlang.term_to_binary(x))
+        end
+      end
+    [{External, beam}] = Code.compile_quoted(quoted)
+    output = Ex2c.compile_bytes(beam, etf: true)
+    assert String.starts_with?(output, "#define EX2C_ETF\n")
+    assert String.contains?(output, "erlang_term_to_binary_1()")
+    assert String.contains?(output, "erlang_binary_to_term_1()")
+    Logger.info(output)
+
+    with_native(External, beam, fn ->
+      term = {-70000, 255, 256, :ok, :"é", ~c"hi", [1, :a | 2], "bytes", {}}
+      assert External.Native.encode(term) == :erlang.term_to_binary(term, minor_version: 2)
+      assert External.Native.round_trip(term) == term
+      map = %{a: [1, 2], b: {"x"}}
+      assert External.Native.decode(:erlang.term_to_binary(map)) == map
+      assert External.Native.decode(:erlang.term_to_binary(:"é", minor_version: 0)) == :"é"
+      # Malformed and unsupported input raises badarg
+      assert_raise ArgumentError, fn -> External.Native.decode(<<131, 104, 5, 97>>) end
+      assert_raise ArgumentError, fn -> External.Native.decode(:erlang.term_to_binary(1.5)) end
+      # So do maps repeating a key, and terms nested deeper than the decoder recurses
+      assert_raise ArgumentError, fn -> External.Native.decode(<<131, 116, 2::32, 97, 1, 97, 2, 97, 1, 97, 3>>) end
+      nested = :binary.copy(<<104, 1>>, 100_000)
+      assert_raise ArgumentError, fn -> External.Native.decode(<<131, nested::binary, 106>>) end
+    end)
+  end
+
   @doc """
   Compilation produces the bezout function in C which can be used as follows:
   int main(int argc, char *argv[]) {
@@ -79,6 +301,31 @@ defmodule Ex2cTest do
     Logger.info(output)
   end
 
+  @doc """
+  Compilation with hash-consing shares equal tuples and lists, which can be observed as follows:
+  int main(int argc, char *argv[]) {
+  struct term a = call_1(Elixir2EPairs_pairs_1, make_small(3));
+  struct term b = call_1(Elixir2EPairs_pairs_1, make_small(3));
+  display(a);
+  // Expected output: [{:ok, 3}, {:ok, 3}]
+  printf("%d\\n", a.list.head == b.list.head);
+  // Expected output: 1
+  return 0;
+  }
+  """
+  test "compile with hash-consed term construction" do
+    quoted =
+      quote do
+        defmodule Pairs do
+          def pairs(x), do: [{:ok, x}, {:ok, x}]
+        end
+      end
+    output = Ex2c.compile_bytes(Code.compile_quoted(quoted)[Pairs], hashcons: true)
+    assert String.starts_with?(output, "#define EX2C_HASHCONS\n")
+    assert String.contains?(output, "make_tuple_shared")
+    Logger.info(output)
+  end
+
   @doc """
   Compilation produces a merge sort function in C which can be used as follows:
   int main(int argc, char *argv[]) {
@@ -230,6 +477,19 @@ defmodule Ex2cTest do
     Logger.info(output)
   end
 
+  test "compile a module separately from its dependencies" do
+    quoted =
+      quote do
+        defmodule Reverser do
+          def reverse(x), do: :lists.reverse(x)
+        end
+      end
+    {module, declarations, program, dependencies} = Ex2c.compile_module(Code.compile_quoted(quoted)[Reverser])
+    assert module == Reverser
+    assert :lists in dependencies
+    Logger.info(Ex2c.program_to_string(declarations ++ program))
+  end
+
   @doc """
   Check that the lists built in module can be compiled. Some checks follow:
   int main(int argc, char *argv[]) {
@@ -243,4 +503,150 @@ defmodule Ex2cTest do
     output = Ex2c.compile_bytes(beam)
     Logger.info(output)
   end
+
+  @doc """
+  Whole-program compilation keeps only what the entry points reach, which can be used as follows:
+  int main(int argc, char *argv[]) {
+  display(call_1(Elixir2EWholeReverser_reverse_1, make_list(make_small(1), make_list(make_small(2), make_nil()))));
+  // Expected output: [2, 1]
+  return 0;
+  }
+  """
+  test "compile a whole program from its entry points" do
+    quoted =
+      quote do
+        defmodule WholeReverser do
+          def reverse(x), do: :lists.reverse(x)
+          def unused(x), do: :lists.sort(x)
+        end
+      end
+    {:lists, lists, _filename} = :code.get_object_code(:lists)
+    output = Ex2c.compile_program([Code.compile_quoted(quoted)[WholeReverser], lists], [{WholeReverser, :reverse, 1}])
+    assert String.contains?(output, "Elixir2EWholeReverser_reverse_1")
+    refute String.contains?(output, "Elixir2EWholeReverser_unused_1")
+    refute String.contains?(output, "lists_sort_1")
+    Logger.info(output)
+  end
+
+  test "compile a Mix project incrementally" do
+    dir = Path.join(System.tmp_dir!(), "ex2c_mix_#{System.unique_integer([:positive])}")
+    File.mkdir_p!(dir)
+    File.write!(Path.join(dir, "mix.exs"), """
+    defmodule Ex2cFixture.MixProject do
+      use Mix.Project
+      def project, do: [app: :ex2c_fixture, version: "0.1.0"]
+    end
+    """)
+
+    write_beam = fn quoted, module, ebin ->
+      File.mkdir_p!(ebin)
+      File.write!(Path.join(ebin, "#{module}.beam"), Code.compile_quoted(quoted)[module])
+    end
+
+    try do
+      Mix.Project.in_project(:ex2c_fixture, dir, fn _module ->
+        ebin = Mix.Project.compile_path()
+        write_beam.(quote(do: defmodule(MixCallee, do: def(f(x), do: x + 1))), MixCallee, ebin)
+        write_beam.(quote(do: defmodule(MixCaller, do: def(g(), do: &MixCallee.f/1))), MixCaller, ebin)
+
+        assert Mix.Tasks.Compile.Ex2c.run([]) == {:ok, []}
+        caller = File.read!("c_src/ex2c/Elixir2EMixCaller.c")
+        # The fun literal alone makes the callee's declarations necessary
+        assert String.contains?(caller, "#include \"Elixir2EMixCallee.h\"")
+        assert File.read!("c_src/ex2c/ex2c.c") =~ "#include \"Elixir2EMixCallee.c\""
+
+        assert Mix.Tasks.Compile.Ex2c.run([]) == {:noop, []}
+
+        write_beam.(quote(do: defmodule(MixCallee, do: def(f(x), do: x + 2))), MixCallee, ebin)
+        assert Mix.Tasks.Compile.Ex2c.run([]) == {:ok, []}
+        assert File.read!("c_src/ex2c/Elixir2EMixCaller.c") == caller
+
+        File.rm!(Path.join(ebin, "Elixir.MixCallee.beam"))
+        assert Mix.Tasks.Compile.Ex2c.run(["--force"]) == {:ok, []}
+        refute File.exists?("c_src/ex2c/Elixir2EMixCallee.h")
+        refute File.exists?("c_src/ex2c/Elixir2EMixCallee.c")
+      end)
+    after
+      File.rm_rf!(dir)
+    end
+  end
+
+  test "generate a NIF shim around a compiled module" do
+    quoted =
+      quote do
+        defmodule NativeGCD do
+          def gcd(a, 0), do: a
+          def gcd(a, b), do: gcd(b, Kernel.rem(a, b))
+        end
+      end
+    output = Ex2c.Nif.shim(Code.compile_quoted(quoted)[NativeGCD])
+    assert String.contains?(output, "{\"gcd\", 2, nif_Elixir2ENativeGCD_gcd_2, 0}")
+    assert String.contains?(output, "{\"gcd_dirty\", 2, nif_Elixir2ENativeGCD_gcd_2, ERL_NIF_DIRTY_JOB_CPU_BOUND}")
+    assert String.contains?(output, "ERL_NIF_INIT(Elixir.NativeGCD.Native,")
+    Logger.info(output)
+  end
+
+  test "benchmark a case against the BEAM" do
+    dir = Path.join(System.tmp_dir!(), "ex2c_bench_#{System.unique_integer([:positive])}")
+    output = Path.join(dir, "results.json")
+
+    try do
+      Mix.Tasks.Ex2c.Bench.run(["gcd", "--iterations", "2", "--build-dir", dir, "--output", output])
+      %{"results" => [result]} = JSON.decode!(File.read!(output))
+      assert %{"name" => "gcd", "iterations" => 2, "correct" => true} = result
+      assert is_integer(result["c"]["wall_ns"]) and is_integer(result["c"]["allocations"])
+      assert is_integer(result["beam"]["reductions"]) and is_integer(result["beam"]["allocated_words"])
+    after
+      File.rm_rf!(dir)
+    end
+  end
+
+  test "call a compiled module loaded as a NIF" do
+    quoted =
+      quote do
+        defmodule NativeEcho do
+          def echo(x), do: x
+          def first([h | _]), do: h
+          def capture(), do: &NativeEcho.echo/1
+          def append(xs, ys), do: xs ++ ys
+          def depth(0), do: 0
+          def depth(n), do: 1 + depth(n - 1)
+        end
+      end
+    [{NativeEcho, beam}] = Code.compile_quoted(quoted)
+
+    with_native(NativeEcho, beam, fn ->
+      term = {1, -70000, :ok, :"é", [1, [2] | 3], "bytes", %{a: [3]}}
+      assert NativeEcho.Native.echo(term) == term
+      assert NativeEcho.Native.echo_dirty(term) == term
+      # Unsupported arguments and results are rejected
+      assert_raise ArgumentError, fn -> NativeEcho.Native.echo(1.5) end
+      assert_raise ErlangError, fn -> NativeEcho.Native.capture() end
+      # Runtime errors are raised in the calling process rather than aborting the node
+      assert_raise FunctionClauseError, fn -> NativeEcho.Native.first([]) end
+      assert NativeEcho.Native.first([:still_alive]) == :still_alive
+      assert_raise ArgumentError, fn -> NativeEcho.Native.append([1 | 2], [3]) end
+      # Overflowing the stack raises rather than corrupting the scheduler
+      assert NativeEcho.Native.depth(1000) == 1000
+      assert_raise SystemLimitError, fn -> NativeEcho.Native.depth(1_000_000) end
+      assert NativeEcho.Native.depth(1000) == 1000
+    end)
+  end
+
+  # Build the given module into a NIF library, load it into M.Native and run fun
+  defp with_native(module, beam, fun) do
+    dir = Path.join(System.tmp_dir!(), "ex2c_nif_#{System.unique_integer([:positive])}")
+    File.mkdir_p!(dir)
+    # Loading looks up the exports of the module on the code path
+    File.write!(Path.join(dir, "#{module}.beam"), beam)
+    :code.add_patha(String.to_charlist(dir))
+
+    try do
+      :ok = Ex2c.Nif.load(module, Ex2c.Nif.build(beam, dir))
+      fun.()
+    after
+      :code.del_path(String.to_charlist(dir))
+      File.rm_rf!(dir)
+    end
+  end
 end